@@ -5,18 +5,26 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
+#include "backend/memory_mapper/memory_mapper.h"
 
 namespace ppim {
 
+class SIMDGenerator;
+
 // Instruction types
 enum class PIMInstructionType {
     PROG,           // Program a core
     EXE,            // Execute an operation
     END,            // End an operation
     MEMORY_READ,    // Read from memory
-    MEMORY_WRITE    // Write to memory
+    MEMORY_WRITE,   // Write to memory
+    HOST_LOAD,      // Stage a DRAM row in from host memory
+    HOST_STORE,     // Stage a DRAM row out to host memory
+    ROW_CLONE,      // Copy a DRAM row to another row in-memory (RowClone)
+    ROUTE           // Move partial results between the clusters of a row
 };
 
 // Operation codes
@@ -24,23 +32,92 @@ enum class PIMOpcode {
     MULTIPLY,
     ADD,
     MAC,
-    RELU
+    RELU,
+    SUBTRACT,
+    SHIFT_LEFT,
+    SHIFT_RIGHT_LOGICAL,
+    SHIFT_RIGHT_ARITHMETIC,
+    AND,
+    OR,
+    XOR
 };
 
 // Instruction structure
 struct PIMInstruction {
     PIMInstructionType type;
     uint8_t coreId;       // Core ID for PROG instructions
+    uint16_t coreMask;    // Cores of each cluster a broadcast PROG programs, one bit each; 0 programs
+                          // coreId only
     PIMOpcode opcode;     // Operation code for EXE instructions
-    uint32_t address;     // Memory address for MEMORY_READ/WRITE instructions
+    uint32_t address;     // Memory address for MEMORY_READ/WRITE instructions; cluster distance for ROUTE
+    uint8_t bankId;       // Bank whose clusters/subarrays the instruction targets
+    uint8_t subarrayId;   // Subarray for MEMORY_READ/WRITE instructions
+    uint32_t srcAddress;  // Source row for ROW_CLONE instructions
+    uint8_t srcBankId;    // Source bank for ROW_CLONE instructions
+    uint8_t srcSubarrayId; // Source subarray for ROW_CLONE instructions
+    uint8_t clusterMask;  // Clusters taking part in an EXE, receiving a ROUTE or a broadcast PROG, one
+                          // bit each; 0 means all
+    uint8_t bufferId;     // Operand buffer (1 or 2) a pipelined READ fills or EXE uses, 3 for the
+                          // stationary operand kept across EXEs; 0 if unbuffered
+    uint16_t repeatCount; // Times an EXE on all clusters runs back to back, up to MaxExeRepeat
+    
+    PIMInstruction() : type(PIMInstructionType::END), coreId(0), coreMask(0), opcode(PIMOpcode::ADD), address(0),
+                       bankId(0), subarrayId(0), srcAddress(0), srcBankId(0), srcSubarrayId(0),
+                       clusterMask(0), bufferId(0), repeatCount(1) {}
+};
+
+// Most executions a single repeated EXE encodes
+const uint32_t MaxExeRepeat = 512;
+
+// Append count executions of exe, as repeated EXEs when it runs on all
+// clusters and one EXE per execution otherwise
+void appendRepeatedExe(const PIMInstruction &exe, uint32_t count, std::vector<PIMInstruction> &out);
+
+// Flat IDs (cluster * coresPerCluster + core) of the cores a PROG programs
+std::vector<uint32_t> getProgrammedCores(const PIMInstruction &instr, uint32_t clustersPerRow,
+                                         uint32_t coresPerCluster);
+
+// Build the fewest PROGs loading opcode into the given cores of a bank: one
+// broadcast PROG per distinct set of cores within a cluster, sent to every
+// cluster that needs that set
+std::vector<PIMInstruction> buildProgInstructions(uint32_t bankId, PIMOpcode opcode,
+                                                  const std::vector<uint32_t> &coreIds,
+                                                  uint32_t clustersPerRow, uint32_t coresPerCluster);
+
+// Core IDs are 6 bits wide
+const uint32_t MaxCoreIds = 64;
+
+// EXE and ROUTE cluster masks hold one bit per cluster; broadcast PROGs
+// reach the first 6 clusters, the others are programmed core by core
+const uint32_t MaxClustersPerRow = 8;
+
+// As above for the cores set in coreMask (bit i for core i), appending the
+// PROGs to out; returns how many were appended
+size_t buildProgInstructions(uint32_t bankId, PIMOpcode opcode, uint64_t coreMask, uint32_t clustersPerRow,
+                             uint32_t coresPerCluster, std::vector<PIMInstruction> &out);
+
+// Statistics gathered from a pPIM instruction stream
+struct InstructionStats {
+    uint64_t progCount;
+    uint64_t exeCount;
+    uint64_t exeExecutions;      // Executions of the EXEs, counting repeats
+    uint64_t endCount;
+    uint64_t readCount;
+    uint64_t writeCount;
+    uint64_t hostTransferCount;  // HOST_LOAD and HOST_STORE staging transfers
+    uint64_t rowCloneCount;      // In-DRAM row copies
+    uint64_t routeCount;         // Transfers of partial results between clusters
+    uint64_t rowActivations;     // Memory accesses that open a different row in their bank
     
-    PIMInstruction() : type(PIMInstructionType::END), coreId(0), opcode(PIMOpcode::ADD), address(0) {}
+    InstructionStats() : progCount(0), exeCount(0), exeExecutions(0), endCount(0), readCount(0), writeCount(0),
+                         hostTransferCount(0), rowCloneCount(0), routeCount(0), rowActivations(0) {}
 };
 
 // Code generator class
 class CodeGenerator {
 public:
     CodeGenerator();
+    ~CodeGenerator();
     
     // Generate pPIM instructions from LLVM IR
     bool generatePIMCode(llvm::Module *module, std::vector<PIMInstruction> &instructions);
@@ -51,7 +128,26 @@ public:
     // Print a pPIM instruction
     void printPIMInstruction(const PIMInstruction &instr);
     
+    // Gather instruction counts and row activations for an instruction stream
+    InstructionStats collectInstructionStats(const std::vector<PIMInstruction> &instructions);
+    
+    // Print instruction statistics
+    void printInstructionStats(const InstructionStats &stats);
+    
+    // Get the memory mapper holding the placement of the last generated code
+    const MemoryMapper &getMemoryMapper() const { return memMapper; }
+    
+    // Get the SIMD generator holding the dataflow report of the last multiplication
+    const SIMDGenerator &getSIMDGenerator() const { return *simdGenerator; }
+
 private:
+    MemoryMapper memMapper;
+    std::unique_ptr<SIMDGenerator> simdGenerator;
+    
+    // Generate pPIM instructions for the matrix multiplication function F
+    bool generateMatrixMultiplicationCode(llvm::Function &F, std::vector<PIMInstruction> &instructions,
+                                          MemoryMapper &memMapper);
+    
     // Generate pPIM instructions for a single LLVM instruction
     std::vector<PIMInstruction> generateInstructionsForLLVMInst(llvm::Instruction *inst);
     
@@ -60,6 +156,9 @@ private:
     
     // Encode a pPIM instruction into a 24-bit value
     uint32_t encodeInstruction(const PIMInstruction &instr);
+    
+    // Encode the bank select directing the following instructions to a bank and subarray
+    uint32_t encodeBankSelect(uint8_t bankId, uint8_t subarrayId);
 };
 
 } // namespace ppim
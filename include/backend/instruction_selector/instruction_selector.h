@@ -3,41 +3,184 @@
 
 #include <vector>
 #include <string>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
 #include "backend/code_generator/code_generator.h"
+#include "backend/memory_mapper/memory_mapper.h"
 
 namespace ppim {
 
+// A chain of add(x, mul(a, b)) operations that reduces to one MAC sequence
+struct MACChain {
+    uint32_t numProducts;        // Multiplies accumulated by the chain
+    llvm::Value *accumulator;    // Initial accumulator value (x), if any
+    
+    MACChain() : numProducts(0), accumulator(nullptr) {}
+};
+
+// PROG counts with and without LUT state tracking
+struct LUTProgrammingStats {
+    uint64_t progRequested;    // Per-core PROGs needed without state tracking or broadcast
+    uint64_t progEmitted;      // PROG instructions emitted, each broadcast to the cores sharing it
+    uint64_t coresProgrammed;  // Cores whose LUTs held another function
+    
+    LUTProgrammingStats() : progRequested(0), progEmitted(0), coresProgrammed(0) {}
+};
+
 class InstructionSelector {
 public:
     InstructionSelector();
-
+    
+    // Initialize the instruction selector with architecture parameters; returns
+    // false, leaving it unchanged, if instructions cannot address them
+    bool initialize(uint32_t clustersPerRow, uint32_t coresPerCluster);
+    
     // Select pPIM instructions for a given LLVM IR instruction
     std::vector<PIMInstruction> selectInstructions(llvm::Instruction* inst);
-
+    
+    // Append the pPIM instructions for a given LLVM IR instruction to out
+    void selectInstructions(llvm::Instruction* inst, std::vector<PIMInstruction>& out);
+    
     // Select pPIM instructions for a basic block
     std::vector<PIMInstruction> selectInstructionsForBasicBlock(llvm::BasicBlock& bb);
-
+    
     // Select pPIM instructions for a function
     std::vector<PIMInstruction> selectInstructionsForFunction(llvm::Function& func);
+    
+    // Select pPIM instructions for every function of a module, in module order
+    std::vector<PIMInstruction> selectInstructionsForModule(llvm::Module& module);
+    
+    // Set the number of threads used to select basic blocks: 1 selects
+    // serially, 0 uses every host core. The output does not depend on it.
+    void setNumThreads(unsigned numThreads) { NumThreads = numThreads; }
+    
+    // Set the memory mapper used to resolve load and store addresses; the
+    // mapper must already have mapped the module's values
+    void setMemoryMapper(const MemoryMapper* memMapper) { MemMapper = memMapper; }
+    
+    // Forget the LUT contents of every core, e.g. before an independent stream
+    void resetLUTState();
+    
+    // Get the PROG counts gathered so far
+    const LUTProgrammingStats& getLUTProgrammingStats() const { return LUTStats; }
 
 private:
-    // Helper functions for specific instruction types
-    std::vector<PIMInstruction> selectForBinaryOp(llvm::BinaryOperator* binOp);
-    std::vector<PIMInstruction> selectForLoad(llvm::LoadInst* load);
-    std::vector<PIMInstruction> selectForStore(llvm::StoreInst* store);
-    std::vector<PIMInstruction> selectForCall(llvm::CallInst* call);
-
-    // Helper function to generate LUT programming instructions
-    std::vector<PIMInstruction> generateLUTProgrammingInstructions(PIMOpcode opcode);
-
-    // Helper function to generate memory access instructions
-    PIMInstruction generateMemoryAccessInstruction(bool isRead, uint32_t address);
-
-    // Helper function to generate SIMD instructions
-    std::vector<PIMInstruction> generateSIMDInstructions(PIMOpcode opcode, int vectorSize);
+    // Emitter appending the instructions selected for one LLVM instruction
+    typedef void (InstructionSelector::*Emitter)(llvm::Instruction* inst, PIMOpcode opcode,
+                                                 std::vector<PIMInstruction>& out);
+    
+    // Selection pattern for one LLVM opcode
+    struct SelectionPattern {
+        Emitter emit;        // Null for instructions that select to nothing
+        PIMOpcode opcode;    // Operation passed to the emitter
+    };
+    
+    // Patterns indexed by llvm::Instruction::getOpcode()
+    struct SelectionTable {
+        SelectionPattern patterns[llvm::Instruction::OtherOpsEnd];
+    };
+    
+    // Build the selection table; evaluated at compile time
+    static constexpr SelectionTable buildSelectionTable();
+    static const SelectionTable PatternTable;
+    
+    // Core IDs are 6 bits wide
+    static const uint32_t MaxCores = 64;
+    
+    const MemoryMapper* MemMapper;
+    unsigned NumThreads;
+    uint32_t ClustersPerRow;    // Number of clusters in a row (typically 4)
+    uint32_t CoresPerCluster;   // Number of cores per cluster (typically 9)
+    
+    // Function currently loaded in each core's LUTs, or -1 if the core has
+    // not been programmed or its contents are unknown
+    int CoreLUTState[MaxCores];
+    LUTProgrammingStats LUTStats;
+    
+    // LUT state at the end of each block selected so far in the current function
+    llvm::DenseMap<const llvm::BasicBlock*, std::vector<int>> BlockExitLUTState;
+    
+    // MAC chains of the current basic block: product counts by final add,
+    // and the adds and multiplies absorbed into a chain
+    llvm::DenseMap<const llvm::Instruction*, uint32_t> ChainProducts;
+    llvm::DenseSet<const llvm::Instruction*> Absorbed;
+    std::vector<const llvm::Instruction*> PendingAbsorbed;
+    
+    // Select a basic block, appending to out
+    void selectBasicBlock(llvm::BasicBlock& bb, std::vector<PIMInstruction>& out);
+    
+    // Set the LUT state on entry to bb: a core keeps its function only if
+    // every predecessor of bb has been selected and leaves that function in it
+    void enterBlockLUTState(const llvm::BasicBlock& bb);
+    
+    // Record the LUT state on exit from bb for its successors
+    void leaveBlockLUTState(const llvm::BasicBlock& bb);
+    
+    // Select blocks on a pool of threads and concatenate the results in
+    // order; the blocks of each function must be contiguous and in layout order
+    void selectBlocksInParallel(const std::vector<llvm::BasicBlock*>& blocks,
+                                std::vector<PIMInstruction>& out);
+    
+    // Emitters for specific instruction types
+    void emitBinaryOp(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    void emitUnsupportedBinaryOp(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    void emitLoad(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    void emitStore(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    void emitCall(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    void emitSelect(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    
+    // Emit a single-input LUT operation such as ReLU
+    void emitUnaryOp(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    
+    // Check whether inst computes max(x, 0), either as smax(x, 0) or as
+    // select(icmp sgt x, 0, x, 0)
+    static bool matchReLU(llvm::Instruction* inst);
+    
+    // Match the add(x, mul(a, b)) chain ending at root, returning false if
+    // it does not contain at least one fusible multiply
+    bool matchMACChain(llvm::BinaryOperator* root, MACChain& chain);
+    
+    // Collect the terms of an add chain rooted at value into chain, recording
+    // the instructions it absorbs in PendingAbsorbed
+    bool collectMACTerms(llvm::Value* value, llvm::BasicBlock* bb, bool isRoot, MACChain& chain);
+    
+    // Emit a single MAC sequence for a chain of numProducts products
+    void emitMACChain(uint32_t numProducts, std::vector<PIMInstruction>& out);
+    
+    // Cores, relative to the first core of its lane, that compute opcode
+    // for an element of elementBytes bytes
+    static void getLaneCores(PIMOpcode opcode, uint32_t elementBytes, uint32_t& firstCore, uint32_t& lastCore);
+    
+    // Emit LUT programming instructions for the cores that do not already
+    // hold the LUTs for opcode
+    void emitLUTProgramming(PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    
+    // Emit the PROGs for the cores that do not already hold the LUTs for
+    // opcode among those set in coreMask (bit i for core i), broadcasting one
+    // control word to as many of them as possible
+    void programCores(uint64_t coreMask, PIMOpcode opcode, std::vector<PIMInstruction>& out);
+    
+    // Emit numExecutions executions of an EXE, repeated in as few
+    // instructions as the encoding allows, followed by an END
+    void emitCompute(PIMOpcode opcode, uint32_t numExecutions, std::vector<PIMInstruction>& out);
+    
+    // Emit a memory access instruction
+    void emitMemoryAccess(bool isRead, const PhysicalMemoryLocation& location, std::vector<PIMInstruction>& out);
+    
+    // Resolve a pointer to the physical location it addresses
+    PhysicalMemoryLocation resolveAddress(llvm::Value* ptr, const llvm::DataLayout& dataLayout);
+    
+    // Merge accesses to the same row within each run of consecutive reads or
+    // writes from index begin onwards, so that every row is activated once per run
+    void coalesceRowAccesses(std::vector<PIMInstruction>& instructions, size_t begin);
+    
+    // Emit SIMD instructions for a vector operation of numElements elements
+    // of elementBits each
+    void emitSIMD(PIMOpcode opcode, uint32_t numElements, uint32_t elementBits, std::vector<PIMInstruction>& out);
 };
 
 } // namespace ppim
@@ -0,0 +1,60 @@
+#ifndef PPIM_MEMORY_MAP_EXPORTER_H
+#define PPIM_MEMORY_MAP_EXPORTER_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include "backend/code_generator/code_generator.h"
+#include "backend/memory_mapper/memory_mapper.h"
+
+namespace ppim {
+
+// Access counts gathered for a single subarray from an instruction stream
+struct SubarrayAccessStats {
+    uint64_t reads;           // MEMORY_READ and HOST_STORE accesses
+    uint64_t writes;          // MEMORY_WRITE, HOST_LOAD and ROW_CLONE destination accesses
+    uint32_t rowsAccessed;    // Distinct rows touched
+    
+    SubarrayAccessStats() : reads(0), writes(0), rowsAccessed(0) {}
+};
+
+// Exports the placement of matrices and values, subarray occupancy and
+// cluster access counts of a memory mapper
+class MemoryMapExporter {
+public:
+    explicit MemoryMapExporter(const MemoryMapper &memMapper);
+    
+    // Gather per-subarray and per-cluster access counts from an instruction stream
+    void recordAccesses(const std::vector<PIMInstruction> &instructions);
+    
+    // Write the memory map as a single JSON document
+    bool writeJSON(const std::string &filename) const;
+    
+    // Write the memory map as CSV tables: <basePath>_layouts.csv,
+    // <basePath>_subarrays.csv and <basePath>_clusters.csv
+    bool writeCSV(const std::string &basePath) const;
+    
+    // Write an HTML page with SVG heatmaps of subarray occupancy and accesses
+    bool writeHeatmap(const std::string &filename) const;
+
+private:
+    const MemoryMapper &Mapper;
+    
+    std::vector<SubarrayAccessStats> SubarrayAccesses;  // Indexed by global subarray ID
+    std::vector<uint64_t> ClusterAccesses;              // Indexed by global cluster ID
+    std::vector<std::vector<bool>> RowsTouched;         // Per subarray, per row
+    
+    // Count one access to a row
+    void recordAccess(uint32_t bankId, uint32_t subarrayId, uint32_t row, bool isWrite);
+    
+    // Write the rows of the layouts table
+    void writeLayoutRows(std::ostream &out) const;
+    
+    // Write one SVG grid of banks by subarrays, shading each cell by its value
+    void writeHeatmapGrid(std::ostream &out, const std::string &title,
+                          const std::vector<double> &values, const std::vector<std::string> &labels) const;
+};
+
+} // namespace ppim
+
+#endif // PPIM_MEMORY_MAP_EXPORTER_H
@@ -3,12 +3,21 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 
 namespace ppim {
 
+// Largest geometry instructions can address: bank selects hold 6-bit bank
+// IDs, instructions 8-bit subarray IDs and memory accesses 9-bit rows
+const uint32_t MaxBanks = 64;
+const uint32_t MaxSubarraysPerBank = 256;
+const uint32_t MaxRowsPerSubarray = 512;
+
 // Structure to represent a physical memory location in the pPIM architecture
 struct PhysicalMemoryLocation {
     uint32_t bankId;       // Bank ID
@@ -21,6 +30,20 @@ struct PhysicalMemoryLocation {
     
     PhysicalMemoryLocation(uint32_t bank, uint32_t subarray, uint32_t row, uint32_t col) 
         : bankId(bank), subarrayId(subarray), rowAddress(row), columnOffset(col) {}
+    
+    // Encode as a single 64-bit address: bank in bits 56-63, subarray in
+    // bits 48-55, row in bits 32-47 and column offset in bits 0-31
+    uint64_t pack() const {
+        return (static_cast<uint64_t>(bankId & 0xFF) << 56) |
+               (static_cast<uint64_t>(subarrayId & 0xFF) << 48) |
+               (static_cast<uint64_t>(rowAddress & 0xFFFF) << 32) |
+               columnOffset;
+    }
+    
+    static PhysicalMemoryLocation unpack(uint64_t packed) {
+        return PhysicalMemoryLocation(packed >> 56, (packed >> 48) & 0xFF,
+                                      (packed >> 32) & 0xFFFF, packed & 0xFFFFFFFF);
+    }
 };
 
 // Structure to represent a matrix in physical memory
@@ -30,11 +53,105 @@ struct MatrixMemoryLayout {
     uint32_t cols;
     bool rowMajor;  // True if matrix is stored in row-major format
     
+    // Tiled storage: the matrix is split along its major dimension (rows when
+    // row-major, columns otherwise) into tiles of tileSize slices, each placed
+    // at its own location. tileSize is 0 when the matrix is stored contiguously.
+    uint32_t tileSize;
+    std::vector<PhysicalMemoryLocation> tileLocations;
+    
+    // Spilled storage: a matrix that does not fit in device memory stays in
+    // host memory, and a window of residentSlices major-dimension slices
+    // starting at startLocation is staged in and out of DRAM. Slice s of the
+    // matrix occupies window slot s % residentSlices.
+    bool hostResident;
+    uint32_t residentSlices;
+    
+    // Read-only copies of the matrix placed in the subarrays that consume it,
+    // each stored contiguously in the matrix's storage order. A replica owns
+    // whole rows and starts at the column the matrix starts at, so every row
+    // of it is a RowClone of one row of the matrix.
+    std::vector<PhysicalMemoryLocation> replicaLocations;
+    
     MatrixMemoryLayout() 
-        : rows(0), cols(0), rowMajor(true) {}
+        : rows(0), cols(0), rowMajor(true), tileSize(0), hostResident(false), residentSlices(0) {}
     
     MatrixMemoryLayout(PhysicalMemoryLocation start, uint32_t r, uint32_t c, bool isRowMajor) 
-        : startLocation(start), rows(r), cols(c), rowMajor(isRowMajor) {}
+        : startLocation(start), rows(r), cols(c), rowMajor(isRowMajor), tileSize(0),
+          hostResident(false), residentSlices(0) {}
+};
+
+// Half-open range of matrix indices [begin, end)
+struct IndexRange {
+    uint32_t begin;
+    uint32_t end;
+    
+    IndexRange(uint32_t b, uint32_t e) : begin(b), end(e) {}
+};
+
+// Affine run of matrix elements in device memory: element k is at global
+// byte address base + (k % wrap) * stride
+struct StridedAccess {
+    uint64_t base;     // Global byte address of the first element
+    uint32_t stride;   // Bytes between consecutive elements
+    uint32_t count;    // Number of elements
+    uint32_t wrap;     // Elements after which the run returns to base; 0 if it never does
+    
+    StridedAccess() : base(0), stride(0), count(0), wrap(0) {}
+    
+    StridedAccess(uint64_t b, uint32_t s, uint32_t c, uint32_t w = 0)
+        : base(b), stride(s), count(c), wrap(w) {}
+};
+
+// Structure to record the effect of operand layout selection
+struct LayoutSelectionStats {
+    uint32_t operandsTransposed;      // Right-hand operands stored column-major
+    uint64_t rowActivationsRowMajor;  // Estimated operand row activations with row-major storage
+    uint64_t rowActivationsSelected;  // Estimated operand row activations with the selected layouts
+    
+    LayoutSelectionStats()
+        : operandsTransposed(0), rowActivationsRowMajor(0), rowActivationsSelected(0) {}
+};
+
+// Structure to record the effect of operand replication
+struct ReplicationStats {
+    uint32_t replicasCreated;       // Subarray-local copies of read-only operands
+    uint64_t bytesReplicated;       // Extra device memory held by replicas
+    uint64_t remoteBytesAvoided;    // Estimated operand bytes no longer read from other subarrays
+    
+    ReplicationStats() : replicasCreated(0), bytesReplicated(0), remoteBytesAvoided(0) {}
+};
+
+// Placement policies for distributing matrices across banks and subarrays
+enum class PlacementPolicy {
+    SEQUENTIAL,         // Fill bank 0, subarray 0 first (first subarray with room)
+    BANK_INTERLEAVED,   // Place successive matrices in successive banks
+    SUBARRAY_STRIPED,   // Stripe the tiles of each matrix across banks and subarrays
+    COLOCATE_OPERANDS   // Stripe tiles so that A-row and B-column tiles share subarrays
+};
+
+// Structure to describe how much of a single subarray is in use
+struct SubarrayOccupancy {
+    uint32_t bankId;
+    uint32_t subarrayId;
+    uint64_t usedBytes;       // Bytes held by live allocations
+    uint32_t rowsAllocated;   // Rows overlapping at least one live allocation
+    
+    SubarrayOccupancy() : bankId(0), subarrayId(0), usedBytes(0), rowsAllocated(0) {}
+};
+
+// Structure to summarize allocator occupancy and fragmentation
+struct MemoryUsageStats {
+    uint64_t totalBytes;        // Capacity of the device
+    uint64_t usedBytes;         // Bytes held by live allocations
+    uint64_t freeBytes;         // Bytes available for allocation
+    uint64_t largestFreeBlock;  // Largest contiguous free block within a subarray
+    uint32_t numFreeBlocks;     // Number of free blocks across all subarrays
+    uint32_t numAllocations;    // Number of live allocations
+    double fragmentation;       // Share of free bytes outside each subarray's largest free block
+    
+    MemoryUsageStats()
+        : totalBytes(0), usedBytes(0), freeBytes(0), largestFreeBlock(0),
+          numFreeBlocks(0), numAllocations(0), fragmentation(0.0) {}
 };
 
 // Memory mapper class
@@ -42,35 +159,123 @@ class MemoryMapper {
 public:
     MemoryMapper();
     
-    // Initialize the memory mapper with architecture parameters
-    void initialize(uint32_t numBanks, uint32_t numSubarraysPerBank, 
+    // Initialize the memory mapper with architecture parameters; returns false,
+    // leaving the mapper unchanged, if instructions cannot address them
+    bool initialize(uint32_t numBanks, uint32_t numSubarraysPerBank, 
                    uint32_t numRowsPerSubarray, uint32_t numColsPerRow);
     
+    // Set the policy used to place matrices across banks and subarrays
+    void setPlacementPolicy(PlacementPolicy policy) { Policy = policy; }
+    PlacementPolicy getPlacementPolicy() const { return Policy; }
+    
+    // Set the number of rows (or columns) per tile for striped placement
+    void setTileSize(uint32_t size) { TileSize = size; }
+    
     // Map a matrix to physical memory
-    MatrixMemoryLayout mapMatrix(const std::string &name, uint32_t rows, uint32_t cols);
+    MatrixMemoryLayout mapMatrix(const std::string &name, uint32_t rows, uint32_t cols,
+                                 bool rowMajor = true);
+    
+    // Map a matrix that stays in host memory, staging a window of at most
+    // maxResidentSlices rows (or columns if column-major) into DRAM
+    MatrixMemoryLayout mapSpilledMatrix(const std::string &name, uint32_t rows, uint32_t cols,
+                                        bool rowMajor, uint32_t maxResidentSlices);
+    
+    // Map the operands of resultMatrix = matrixA x matrixB, spilling them to
+    // staged windows when together they exceed the free device memory
+    bool mapMatrixMultiplication(const std::string &matrixA, const std::string &matrixB,
+                                 const std::string &resultMatrix,
+                                 uint32_t rowsA, uint32_t colsA, uint32_t colsB);
+    
+    // Release the physical memory held by a matrix
+    bool unmapMatrix(const std::string &name);
     
     // Get the physical memory location for a matrix element
-    PhysicalMemoryLocation getElementLocation(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col);
+    PhysicalMemoryLocation getElementLocation(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col) const;
+    
+    // Append the physical locations of a block of matrix elements to out,
+    // in row-major order of the block
+    void getTileLocations(const MatrixMemoryLayout &matrix, IndexRange rowRange, IndexRange colRange,
+                          std::vector<PhysicalMemoryLocation> &out) const;
+    
+    // Append strided accesses covering a block of matrix elements to out, in
+    // storage order; a block of whole slices takes one access per tile it
+    // crosses, and any other block one access per slice
+    void getTileAccesses(const MatrixMemoryLayout &matrix, IndexRange rowRange, IndexRange colRange,
+                         std::vector<StridedAccess> &out) const;
+    
+    // Append the location of the first element of a strided access in each
+    // DRAM row it touches, stepping from row to row arithmetically
+    void getAccessRows(const StridedAccess &access, std::vector<PhysicalMemoryLocation> &out) const;
     
     // Map LLVM values to physical memory locations
     bool mapValues(llvm::Module *module);
     
     // Get the physical memory location for an LLVM value
-    PhysicalMemoryLocation getValueLocation(llvm::Value *value);
+    PhysicalMemoryLocation getValueLocation(llvm::Value *value) const;
     
-    // Get the matrix memory layout for a matrix name
-    MatrixMemoryLayout getMatrixLayout(const std::string &name);
+    // Check if an LLVM value has been mapped
+    bool isValueMapped(const llvm::Value *value) const { return ValueLocations.count(value) != 0; }
+    
+    // Get the location a number of bytes past another location
+    PhysicalMemoryLocation offsetLocation(const PhysicalMemoryLocation &location, uint64_t bytes) const;
+    
+    // Get the matrix memory layout for a matrix name (an empty layout if the
+    // matrix is not mapped)
+    MatrixMemoryLayout getMatrixLayout(const std::string &name) const;
     
     // Check if a matrix is already mapped
-    bool isMatrixMapped(const std::string &name);
+    bool isMatrixMapped(const std::string &name) const;
     
     // Optimize memory layout for matrix multiplication
     bool optimizeForMatrixMultiplication(const std::string &matrixA, const std::string &matrixB, 
                                         const std::string &resultMatrix);
     
+    // Set the minimum ratio of remote operand bytes avoided to bytes
+    // duplicated for an operand to be replicated (0, the default, disables
+    // replication)
+    void setReplicationThreshold(double threshold) { ReplicationThreshold = threshold; }
+    
+    // Copy a read-only operand into the subarrays holding the rows of a
+    // consumer matrix where the cost model favours it; returns the number of
+    // replicas created
+    uint32_t replicateOperand(const std::string &name, const std::string &consumer);
+    
+    // Get the replica of a matrix stored in the subarray of a consumer
+    // location, returning false if there is none
+    bool getLocalReplica(const MatrixMemoryLayout &matrix, const PhysicalMemoryLocation &consumer,
+                         MatrixMemoryLayout &replica) const;
+    
+    // Get the statistics gathered by operand replication
+    const ReplicationStats &getReplicationStats() const { return ReplStats; }
+    
+    // Get the statistics gathered by operand layout selection
+    const LayoutSelectionStats &getLayoutSelectionStats() const { return LayoutStats; }
+    
     // Get the pPIM cluster ID for a physical memory location
-    uint32_t getClusterIdForLocation(const PhysicalMemoryLocation &location);
+    uint32_t getClusterIdForLocation(const PhysicalMemoryLocation &location) const;
+    
+    // Get the architecture parameters
+    uint32_t getNumBanks() const { return NumBanks; }
+    uint32_t getNumSubarraysPerBank() const { return NumSubarraysPerBank; }
+    uint32_t getNumRowsPerSubarray() const { return NumRowsPerSubarray; }
+    uint32_t getNumColsPerRow() const { return NumColsPerRow; }
+    uint32_t getNumClustersPerSubarray() const { return NumClustersPerSubarray; }
+    
+    // Get the names of all mapped matrices, sorted
+    std::vector<std::string> getMatrixNames() const;
+    
+    // Get the locations of all mapped LLVM values
+    std::vector<std::pair<const llvm::Value*, PhysicalMemoryLocation>> getValueLocations() const;
+    
+    // Get the occupancy of every subarray, indexed by global subarray ID
+    std::vector<SubarrayOccupancy> getSubarrayOccupancy() const;
     
+    // Get the total capacity of the device in bytes
+    uint64_t getCapacity() const { return SubarrayBytes * FreeLists.size(); }
+    
+    // Get occupancy and fragmentation statistics for the allocator
+    MemoryUsageStats getMemoryUsageStats() const;
+
 private:
     // Architecture parameters
     uint32_t NumBanks;
@@ -79,21 +284,75 @@ private:
     uint32_t NumColsPerRow;
     uint32_t NumClustersPerSubarray;  // Typically 4 as per the reference paper
     
+    uint64_t SubarrayBytes;           // NumRowsPerSubarray * NumColsPerRow
+    
+    // Placement state
+    PlacementPolicy Policy;
+    uint32_t TileSize;                // Slices per tile for striped placement
+    uint32_t NextBank;                // Next bank for bank-interleaved placement
+    uint32_t NextStripe;              // First stripe of the next striped matrix
+    double ReplicationThreshold;      // Remote bytes avoided per replicated byte
+    
+    // Free blocks of a single subarray, indexed both by offset (for coalescing)
+    // and by length (for best-fit allocation)
+    struct SubarrayFreeList {
+        std::map<uint64_t, uint64_t> byOffset;             // Offset -> length
+        std::set<std::pair<uint64_t, uint64_t>> bySize;    // (length, offset)
+        uint64_t freeBytes;
+        
+        SubarrayFreeList() : freeBytes(0) {}
+    };
+    
     // Memory allocation tracking
-    uint32_t NextAvailableBank;
-    uint32_t NextAvailableSubarray;
-    uint32_t NextAvailableRow;
-    uint32_t NextAvailableCol;
+    std::vector<SubarrayFreeList> FreeLists;   // Indexed by global subarray ID
+    std::map<uint64_t, uint64_t> Allocations;  // Global start address -> size of live allocations
+    
+    // Maps to track memory allocations; value locations are stored packed
+    llvm::StringMap<MatrixMemoryLayout> MatrixLayouts;
+    llvm::DenseMap<const llvm::Value*, uint64_t> ValueLocations;
+    
+    // Layout selection and replication results
+    LayoutSelectionStats LayoutStats;
+    ReplicationStats ReplStats;
+    
+    // Estimate the row activations needed to read every column of a matrix once
+    uint64_t countColumnReadActivations(const MatrixMemoryLayout &layout) const;
+    
+    // Reset the allocator so that the whole device is free
+    void resetAllocator();
+    
+    // Convert between physical locations and global (linear) byte addresses
+    uint64_t getGlobalAddress(const PhysicalMemoryLocation &location) const;
+    PhysicalMemoryLocation getPhysicalLocation(uint64_t globalAddress) const;
+    
+    // Get the global address of a matrix element
+    uint64_t getElementAddress(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col) const;
+    
+    // Helper function to allocate memory for a matrix, searching from the
+    // given global subarray ID onwards
+    bool allocateMemory(uint64_t size, PhysicalMemoryLocation &location,
+                        uint32_t startSubarray = 0);
+    
+    // Best-fit allocation within a single subarray
+    bool allocateInSubarray(uint64_t size, uint32_t subarray, PhysicalMemoryLocation &location);
+    
+    // Best-fit allocation of whole rows, starting at column 0, within a single subarray
+    bool allocateRowsInSubarray(uint32_t numRows, uint32_t subarray, PhysicalMemoryLocation &location);
+    
+    // Allocate a staging window for a matrix that does not fit in device memory
+    bool allocateSpillWindow(MatrixMemoryLayout &layout, uint32_t maxSlices, uint32_t sliceSize);
     
-    // Maps to track memory allocations
-    std::map<std::string, MatrixMemoryLayout> MatrixLayouts;
-    std::map<llvm::Value*, PhysicalMemoryLocation> ValueLocations;
+    // Get the global subarray ID used for a stripe of striped placement
+    uint32_t getStripeSubarray(uint32_t stripe) const;
     
-    // Helper function to allocate memory for a matrix
-    PhysicalMemoryLocation allocateMemory(uint32_t size);
+    // Helper function to release an allocation starting at the given location
+    bool freeMemory(const PhysicalMemoryLocation &location);
     
-    // Helper function to check if a memory region is available
-    bool isMemoryAvailable(const PhysicalMemoryLocation &location, uint32_t size);
+    // Helper functions to carve a range out of, or return it to, the free lists
+    void reserveRange(uint64_t globalAddress, uint64_t size);
+    void releaseRange(uint64_t globalAddress, uint64_t size);
+    void insertFreeBlock(uint32_t subarray, uint64_t offset, uint64_t length);
+    void eraseFreeBlock(uint32_t subarray, std::map<uint64_t, uint64_t>::iterator block);
 };
 
 } // namespace ppim
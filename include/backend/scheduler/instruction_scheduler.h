@@ -0,0 +1,142 @@
+#ifndef PPIM_INSTRUCTION_SCHEDULER_H
+#define PPIM_INSTRUCTION_SCHEDULER_H
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include "backend/code_generator/code_generator.h"
+
+namespace ppim {
+
+// Costs and limits of the target used to rank schedules
+struct TargetDescription {
+    uint32_t clustersPerRow;     // Clusters sharing a row (typically 4)
+    uint32_t coresPerCluster;    // Cores per cluster (typically 9)
+    double progCost;             // One PROG, which may broadcast to several cores
+    double rowActivationCost;    // Opening a different row in a bank
+    double rowHitCost;           // Accessing the row already open in a bank
+    uint32_t lookahead;          // Ready tasks considered at each scheduling step
+    
+    TargetDescription()
+        : clustersPerRow(4), coresPerCluster(9), progCost(20.0), rowActivationCost(5.0),
+          rowHitCost(1.0), lookahead(64) {}
+};
+
+// Effect of scheduling on an instruction stream
+struct SchedulerStats {
+    uint64_t tasks;                    // Scheduling units the stream was split into
+    uint64_t progBefore;               // PROG instructions in the input stream
+    uint64_t progAfter;                // PROG instructions in the scheduled stream
+    uint64_t rowActivationsBefore;     // Row activations of the input order
+    uint64_t rowActivationsAfter;      // Row activations of the scheduled order
+    uint64_t criticalPath;             // Tasks on the longest dependency chain
+    uint64_t sameOpcodeRuns;           // Back-to-back runs of two or more independent same-opcode computations
+    uint64_t tasksInRuns;              // Computations in those runs
+    uint64_t hazardViolations;         // Instructions that see other writers or LUTs than in the input
+    
+    SchedulerStats()
+        : tasks(0), progBefore(0), progAfter(0), rowActivationsBefore(0), rowActivationsAfter(0),
+          criticalPath(0), sameOpcodeRuns(0), tasksInRuns(0), hazardViolations(0) {}
+};
+
+// List scheduler that reorders independent operations of a pPIM instruction
+// stream to reduce LUT reprogramming and row-buffer switches
+class InstructionScheduler {
+public:
+    explicit InstructionScheduler(const TargetDescription &target = TargetDescription());
+    
+    // Reorder an instruction stream, respecting the data dependencies
+    // between the rows its operations read and write
+    std::vector<PIMInstruction> schedule(const std::vector<PIMInstruction> &instructions);
+    
+    // Get the statistics of the last schedule
+    const SchedulerStats &getStats() const { return Stats; }
+    
+    // Count the row activations of a stream in order
+    static uint64_t countRowActivations(const std::vector<PIMInstruction> &instructions);
+
+private:
+    // A row of a subarray in a bank
+    typedef std::tuple<uint32_t, uint32_t, uint32_t> RowKey;
+    
+    // A core of a bank
+    typedef std::pair<uint32_t, uint32_t> CoreKey;
+    
+    // An operation of the stream: the reads that feed it, its compute
+    // instructions and the writes of its results. PROGs are not kept; the
+    // cores an operation needs are recorded instead and reprogrammed on demand.
+    struct Task {
+        std::vector<PIMInstruction> instructions;   // Without PROG instructions
+        std::vector<uint32_t> sources;              // Stream index of each instruction
+        std::vector<CoreKey> cores;                 // Cores that must hold opcode
+        PIMOpcode opcode;
+        bool computes;                              // Contains an EXE
+        std::vector<RowKey> reads;
+        std::vector<RowKey> writes;
+        std::vector<uint32_t> successors;
+        uint32_t pendingPredecessors;
+        
+        Task() : opcode(PIMOpcode::ADD), computes(false), pendingPredecessors(0) {}
+    };
+    
+    // Effects of one instruction of a stream on rows, operand buffers, core
+    // results and LUTs, with instructions named by their input index
+    struct InstructionEffects {
+        uint32_t occurrences;               // Times the instruction appears in the stream
+        std::vector<uint32_t> writers;      // Writer each read sees, then writer each write replaces
+        std::vector<uint32_t> lutCores;     // Cores of its bank holding an EXE's function
+        
+        InstructionEffects() : occurrences(0) {}
+    };
+    typedef std::map<uint32_t, InstructionEffects> EffectTrace;
+    
+    // Machine state the cost of the next task depends on
+    struct MachineState {
+        std::map<CoreKey, PIMOpcode> lutState;
+        std::map<uint32_t, std::pair<uint32_t, uint32_t>> openRows;  // Bank -> (subarray, row)
+    };
+    
+    TargetDescription Target;
+    SchedulerStats Stats;
+    
+    // Split an instruction stream into tasks
+    std::vector<Task> buildTasks(const std::vector<PIMInstruction> &instructions);
+    
+    // Pseudo-row standing for an operand buffer of a bank that a READ fills
+    // or an EXE consumes, so that buffer reuse is ordered like row accesses
+    static RowKey getBufferKey(uint32_t bankId, uint32_t bufferId);
+    
+    // Pseudo-row standing for the result a computation leaves in the cores
+    // of a bank instead of writing it to a row, so that the computation
+    // consuming it stays ordered after it
+    static RowKey getCoreResultKey(uint32_t bankId);
+    
+    // Add RAW, WAR and WAW edges between tasks that touch the same rows
+    void addDependencies(std::vector<Task> &tasks);
+    
+    // Length of the longest dependency chain between tasks
+    static uint64_t getCriticalPath(const std::vector<Task> &tasks);
+    
+    // Trace the effects of every instruction of a stream; ids gives the
+    // input index of each instruction, UINT_MAX for PROGs
+    EffectTrace traceEffects(const std::vector<PIMInstruction> &stream, const std::vector<uint32_t> &ids) const;
+    
+    // Count the instructions of a schedule that are missing or duplicated,
+    // see another writer of a row, buffer or core result than in the input,
+    // or run on cores that no longer hold their function. The check replays
+    // both streams instruction by instruction instead of using the tasks.
+    uint64_t countHazardViolations(const std::vector<PIMInstruction> &input, const std::vector<PIMInstruction> &output,
+                                   const std::vector<uint32_t> &sources) const;
+    
+    // Cost of running a task next from the given state
+    double getTaskCost(const Task &task, const MachineState &state) const;
+    
+    // Append a task to the output, reprogramming cores as needed, and the
+    // input index of each instruction appended to sources
+    void emitTask(const Task &task, MachineState &state, std::vector<PIMInstruction> &out,
+                  std::vector<uint32_t> &sources);
+};
+
+} // namespace ppim
+
+#endif // PPIM_INSTRUCTION_SCHEDULER_H
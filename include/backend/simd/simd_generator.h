@@ -2,18 +2,75 @@
 #define PPIM_SIMD_GENERATOR_H
 
 #include <vector>
+#include <map>
+#include <ostream>
 #include "backend/code_generator/code_generator.h"
 #include "backend/memory_mapper/memory_mapper.h"
+#include "backend/scheduler/instruction_scheduler.h"
 
 namespace ppim {
 
+// Dataflow used to map a matrix multiplication onto the clusters
+enum class Dataflow {
+    AUTO,                 // Choose the cheapest dataflow with the cost model
+    OUTPUT_STATIONARY,    // Outputs accumulate in place; both operands are streamed
+    WEIGHT_STATIONARY,    // Columns of B stay in the clusters across rows i (loops interchanged)
+    INPUT_STATIONARY      // Row i of A stays in the clusters across the blocks of columns j
+};
+
+// Modeled cost of lowering a multiplication with one dataflow
+struct DataflowEstimate {
+    Dataflow dataflow;
+    uint64_t instructions;
+    uint64_t reads;             // MEMORY_READ instructions
+    uint64_t rowActivations;    // Accesses that open a different row in their bank
+    uint64_t cycles;            // Modeled device time
+    uint32_t kSplit;            // Clusters sharing the inner dimension of each output
+    bool selected;              // The dataflow used for the generated code
+    
+    DataflowEstimate()
+        : dataflow(Dataflow::AUTO), instructions(0), reads(0), rowActivations(0), cycles(0), kSplit(1),
+          selected(false) {}
+};
+
 // SIMD instruction generator class
 class SIMDGenerator {
 public:
     SIMDGenerator();
     
-    // Initialize the SIMD generator with architecture parameters
-    void initialize(uint32_t clustersPerRow, uint32_t coresPerCluster);
+    // Initialize the SIMD generator with architecture parameters; returns
+    // false, leaving it unchanged, if instructions cannot address them
+    bool initialize(uint32_t clustersPerRow, uint32_t coresPerCluster);
+    
+    // Enable software pipelining: the reads of the next block of outputs
+    // are issued into the other operand buffer while the current block computes
+    void setPipelining(bool enabled) { Pipelined = enabled; }
+    
+    // Split the inner dimension of each output across factor clusters (a
+    // power of two), whose partial sums are combined by an ADD reduction
+    // tree. 0 splits only to fill the clusters that narrow outputs leave idle.
+    void setKSplit(uint32_t factor) { RequestedKSplit = factor; }
+    
+    // Select the dataflow, or AUTO to let the cost model choose per multiplication
+    void setDataflow(Dataflow dataflow) { RequestedDataflow = dataflow; }
+    
+    // Get the estimates of every dataflow for the last multiplication
+    const std::vector<DataflowEstimate> &getDataflowReport() const { return DataflowReport; }
+    
+    // Print the dataflow estimates of the last multiplication
+    void printDataflowReport(std::ostream &out) const;
+    
+    // Model the device time of an instruction stream: per bank, one memory
+    // port overlapped with one compute unit, with MAC EXEs of exeCycles each
+    // and single-pass EXEs and ROUTEs of one cycle
+    static uint64_t estimateCycles(const std::vector<PIMInstruction> &instructions, uint32_t exeCycles,
+                                   const TargetDescription &target = TargetDescription());
+    
+    // Get the name of a dataflow, as accepted by parseDataflow
+    static const char *getDataflowName(Dataflow dataflow);
+    
+    // Parse a dataflow name such as "weight-stationary"
+    static bool parseDataflow(const std::string &name, Dataflow &dataflow);
     
     // Generate SIMD instructions for matrix multiplication
     std::vector<PIMInstruction> generateMatrixMultSIMD(const std::string &matrixA, 
@@ -25,22 +82,92 @@ public:
     std::vector<PIMInstruction> generateAtomicInstructions(PIMOpcode opcode, 
                                                          uint32_t numOperations);
     
-    // Map matrix operations to SIMD instructions
+    // Map matrix operations to SIMD instructions by reordering independent
+    // operations to share LUT configurations and open rows
     std::vector<PIMInstruction> mapToSIMD(const std::vector<PIMInstruction> &instructions);
     
+    // Get the grouping, parallelism and hazard statistics of the last mapToSIMD
+    const SchedulerStats &getMapToSIMDStats() const { return MapStats; }
+
 private:
     uint32_t ClustersPerRow;    // Number of clusters in a row (typically 4)
     uint32_t CoresPerCluster;   // Number of cores per cluster (typically 9)
+    bool Pipelined;             // Double-buffer operand reads against compute
+    Dataflow RequestedDataflow;
+    Dataflow ActiveDataflow;    // Dataflow being generated, never AUTO
+    std::vector<DataflowEstimate> DataflowReport;
+    SchedulerStats MapStats;
+    uint32_t RequestedKSplit;
+    uint32_t ActiveKSplit;      // Clusters per output in the multiplication being generated
+    
+    // Choose the K split for a multiplication with inner dimension k and n
+    // columns of outputs
+    uint32_t chooseKSplit(uint32_t k, uint32_t n) const;
+    
+    // Generate the routes and ADD steps that reduce the partial sums of
+    // numOutputs outputs, each spread over ActiveKSplit adjacent clusters,
+    // into the first cluster of each output
+    std::vector<PIMInstruction> generateReductionTree(uint32_t numOutputs, uint32_t bankId);
+    
+    // Generate a multiplication with ActiveDataflow
+    std::vector<PIMInstruction> generateMatrixMultForDataflow(const MatrixMemoryLayout &layoutA,
+                                                            const MatrixMemoryLayout &layoutB,
+                                                            const MatrixMemoryLayout &layoutC,
+                                                            const MemoryMapper &memMapper);
+    
+    // Output blocks of the rows and columns of C, at most one column per
+    // ActiveKSplit clusters, in the order that keeps the stationary operand resident
+    std::vector<std::pair<uint32_t, IndexRange>> getOutputBlocks(IndexRange rows, IndexRange cols) const;
+    
+    // Generate matrix multiplication with host staging for spilled operands
+    std::vector<PIMInstruction> generateSpilledMatrixMultSIMD(const MatrixMemoryLayout &layoutA,
+                                                            const MatrixMemoryLayout &layoutB,
+                                                            const MatrixMemoryLayout &layoutC,
+                                                            const MemoryMapper &memMapper);
+    
+    // Generate the read, compute and write instructions for the outputs
+    // (i, cols), at most one per cluster, returning the bank whose clusters
+    // compute them. residentKeys holds the stationary row or column block
+    // each bank's clusters already hold and is updated.
+    std::vector<PIMInstruction> generateOutputPacket(const MatrixMemoryLayout &layoutA,
+                                                   const MatrixMemoryLayout &layoutB,
+                                                   const MatrixMemoryLayout &layoutC,
+                                                   uint32_t i, IndexRange cols,
+                                                   const MemoryMapper &memMapper, uint32_t &bankId,
+                                                   std::map<uint32_t, uint32_t> &residentKeys);
+    
+    // Software-pipeline a sequence of output packets: packet t of the result
+    // holds the reads of input packet t and the compute and writes of input
+    // packet t - 1, alternating between two operand buffers. The first
+    // packet is the prologue (reads only) and the last the epilogue.
+    std::vector<std::vector<PIMInstruction>> pipelinePackets(
+        const std::vector<std::vector<PIMInstruction>> &packets);
     
     // Generate SIMD LUT programming instructions
-    std::vector<PIMInstruction> generateSIMDLUTProgramming(PIMOpcode opcode);
+    std::vector<PIMInstruction> generateSIMDLUTProgramming(PIMOpcode opcode, uint32_t bankId = 0);
+    
+    // Generate SIMD compute instructions on the clusters in clusterMask (0 for all)
+    std::vector<PIMInstruction> generateSIMDCompute(PIMOpcode opcode, uint32_t bankId = 0,
+                                                  uint8_t clusterMask = 0);
+    
+    // Generate SIMD memory access instructions, one per DRAM row the
+    // accesses touch
+    std::vector<PIMInstruction> generateSIMDMemoryAccess(bool isRead, const std::vector<StridedAccess> &accesses,
+                                                       const MemoryMapper &memMapper);
+    
+    // Generate host staging instructions for a block of a spilled matrix
+    std::vector<PIMInstruction> generateStagingInstructions(bool toDevice, const MatrixMemoryLayout &layout,
+                                                          IndexRange rowRange, IndexRange colRange,
+                                                          const MemoryMapper &memMapper);
     
-    // Generate SIMD compute instructions
-    std::vector<PIMInstruction> generateSIMDCompute(PIMOpcode opcode);
+    // Generate the row clones that fill the replicas of a matrix
+    std::vector<PIMInstruction> generateReplicationInstructions(const MatrixMemoryLayout &layout,
+                                                              const MemoryMapper &memMapper);
     
-    // Generate SIMD memory access instructions
-    std::vector<PIMInstruction> generateSIMDMemoryAccess(bool isRead, 
-                                                       const std::vector<uint32_t> &addresses);
+    // Interleave per-bank instruction streams so that consecutive work packets
+    // target different banks and can execute concurrently
+    std::vector<PIMInstruction> interleaveBankStreams(
+        const std::map<uint32_t, std::vector<std::vector<PIMInstruction>>> &bankStreams);
 };
 
 } // namespace ppim
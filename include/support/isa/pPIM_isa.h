@@ -16,9 +16,20 @@ enum class InstructionType {
 // Instruction format: 24-bit fixed-length
 // - 2 bits: Instruction type (00: Memory, 01: PROG, 10: EXE, 11: END)
 // - 6 bits: Core pointer/ID (for LUT programming)
-// - 1 bit: Read bit (for memory access)
-// - 1 bit: Write bit (for memory access)
-// - 9 bits: Row address (for memory access)
+// - 1 bit: Read bit (for memory access; on PROG, broadcast the control word
+//   to the clusters in the core field and the cores of each cluster in the
+//   row field, with 0 clusters meaning every cluster)
+// - 1 bit: Write bit (for memory access; read and write together copy the
+//   open row into the addressed row, and neither moves partial results
+//   between clusters: the core field holds the distance and the row field
+//   the receiving clusters)
+// - 1 bit: Host bit (memory access stages the row to/from host memory; with
+//   neither read nor write, selects the bank in the core field and the
+//   subarray in the row field that the following instructions target)
+// - 2 bits: Operand buffer a pipelined read fills or EXE uses (0: none)
+// - 9 bits: Row address (for memory access); for EXE, the mask of clusters
+//   taking part, with 0 meaning every cluster, or with the R bit set, the
+//   number of times the EXE repeats on every cluster minus one
 // - Remaining bits: Reserved or operation-specific
 
 // Control word format: 120-bit
@@ -40,11 +51,34 @@ struct Instruction {
     uint32_t readBit : 1;    // Read bit
     uint32_t writeBit : 1;   // Write bit
     uint32_t rowAddress : 9; // Row address
-    uint32_t reserved : 5;   // Reserved bits
+    uint32_t hostBit : 1;    // Host staging transfer
+    uint32_t bufferId : 2;   // Operand buffer of a pipelined read or EXE
+    uint32_t reserved : 2;   // Reserved bits
     
-    Instruction() : opcode(0), coreId(0), readBit(0), writeBit(0), rowAddress(0), reserved(0) {}
+    Instruction()
+        : opcode(0), coreId(0), readBit(0), writeBit(0), rowAddress(0), hostBit(0), bufferId(0), reserved(0) {}
 };
 
+// Build a PROG loading one control word into several cores at once
+Instruction makeBroadcastProg(uint8_t clusterMask, uint16_t coreMask);
+
+// Build an EXE of a core opcode that runs repeatCount (1-512) times on every cluster
+Instruction makeRepeatedExe(uint8_t exeOpcode, uint32_t repeatCount);
+
+// Build a bank select directing the following instructions to a bank and subarray
+Instruction makeBankSelect(uint8_t bankId, uint16_t subarrayId);
+
+// Check whether a memory instruction is a bank select
+inline bool isBankSelect(const Instruction& inst) {
+    return inst.opcode == 0 && !inst.readBit && !inst.writeBit && inst.hostBit;
+}
+
+// Get the number of times an EXE runs
+inline uint32_t getRepeatCount(const Instruction& inst) { return inst.readBit ? inst.rowAddress + 1 : 1; }
+
+// Check whether a PROG is a broadcast
+inline bool isBroadcastProg(const Instruction& inst) { return inst.opcode == 1 && inst.readBit; }
+
 // Convert between 24-bit instruction and 32-bit representation
 uint32_t encodeInstruction(const Instruction& inst);
 Instruction decodeInstruction(uint32_t encoded);
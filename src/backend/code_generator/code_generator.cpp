@@ -3,7 +3,9 @@
 #include "backend/memory_mapper/memory_mapper.h"
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <fstream>
+#include <map>
 
 namespace ppim {
 
@@ -11,13 +13,16 @@ CodeGenerator::CodeGenerator() : simdGenerator(std::make_unique<SIMDGenerator>()
     simdGenerator->initialize(4, 9); // 4 clusters per row, 9 cores per cluster
 }
 
+CodeGenerator::~CodeGenerator() = default;
+
 bool CodeGenerator::generatePIMCode(llvm::Module *module, std::vector<PIMInstruction> &instructions) {
     if (!module) {
         std::cerr << "Invalid module" << std::endl;
         return false;
     }
     
-    MemoryMapper memMapper;
+    // Start from an empty device for every module
+    memMapper = MemoryMapper();
     
     for (auto &F : *module) {
         if (F.getName() == "matrix_multiply") {
@@ -37,46 +42,109 @@ bool CodeGenerator::generateMatrixMultiplicationCode(llvm::Function &F, std::vec
     }
     
     auto args = F.arg_begin();
-    std::string matrixA = args++->getName();
-    std::string matrixB = args++->getName();
-    std::string resultMatrix = args++->getName();
-    int rowsA = std::stoi(args++->getName());
-    int colsA = std::stoi(args++->getName());
-    int colsB = std::stoi(args++->getName());
-    
-    // Map matrices to memory
-    memMapper.mapMatrix(matrixA, rowsA, colsA);
-    memMapper.mapMatrix(matrixB, colsA, colsB);
-    memMapper.mapMatrix(resultMatrix, rowsA, colsB);
-    
-    // Generate SIMD instructions for matrix multiplication
-    auto simdInstructions = simdGenerator->generateMatrixMultSIMD(matrixA, matrixB, resultMatrix, memMapper);
+    std::string matrixA = args++->getName().str();
+    std::string matrixB = args++->getName().str();
+    std::string resultMatrix = args++->getName().str();
+    int rowsA = std::stoi(args++->getName().str());
+    int colsA = std::stoi(args++->getName().str());
+    int colsB = std::stoi(args++->getName().str());
+    
+    // Map matrices to memory, staging them through DRAM if they do not fit
+    if (!memMapper.mapMatrixMultiplication(matrixA, matrixB, resultMatrix, rowsA, colsA, colsB)) {
+        std::cerr << "Matrices do not fit in device memory" << std::endl;
+        return false;
+    }
     
-    // Convert SIMD instructions to PIM instructions
-    for (const auto &simdInst : simdInstructions) {
-        instructions.push_back(convertToPIMInstruction(simdInst));
+    // Let the placement policy rearrange operands for the multiplication
+    if (!memMapper.optimizeForMatrixMultiplication(matrixA, matrixB, resultMatrix)) {
+        std::cerr << "Failed to map matrices for multiplication" << std::endl;
+        return false;
     }
     
+    // The dataflow can be fixed per multiplication with a function attribute,
+    // e.g. "ppim-dataflow"="weight-stationary"; otherwise the cheapest is used
+    Dataflow dataflow = Dataflow::AUTO;
+    if (F.hasFnAttribute("ppim-dataflow")) {
+        std::string name = F.getFnAttribute("ppim-dataflow").getValueAsString().str();
+        if (!SIMDGenerator::parseDataflow(name, dataflow)) {
+            std::cerr << "Warning: Unknown dataflow " << name << ", using the cost model" << std::endl;
+        }
+    }
+    simdGenerator->setDataflow(dataflow);
+    
+    // Generate SIMD instructions for matrix multiplication; they are
+    // already pPIM instructions
+    auto simdInstructions = simdGenerator->generateMatrixMultSIMD(matrixA, matrixB, resultMatrix, memMapper);
+    instructions.insert(instructions.end(), simdInstructions.begin(), simdInstructions.end());
+    
     return true;
 }
 
-PIMInstruction CodeGenerator::convertToPIMInstruction(const SIMDInstruction &simdInst) {
-    PIMInstruction pimInst;
-    pimInst.type = static_cast<PIMInstructionType>(simdInst.type);
-    pimInst.coreId = simdInst.coreId;
-    pimInst.opcode = static_cast<PIMOpcode>(simdInst.opcode);
-    pimInst.address = simdInst.address;
-    return pimInst;
-}
-
 bool CodeGenerator::savePIMInstructions(const std::vector<PIMInstruction> &instructions, const std::string &filename) {
+    // Bank selects hold 6-bit bank IDs; wider ones would select another bank
+    for (const auto &instr : instructions) {
+        uint32_t bankId = instr.bankId;
+        if (instr.type == PIMInstructionType::ROW_CLONE) {
+            bankId = std::max<uint32_t>(bankId, instr.srcBankId);
+        }
+        if (bankId >= MaxBanks) {
+            std::cerr << "Error: Bank " << bankId << " cannot be encoded; at most " << MaxBanks
+                      << " banks are addressable" << std::endl;
+            return false;
+        }
+    }
+    
     std::ofstream file(filename, std::ios::binary);
     if (!file.is_open()) {
         std::cerr << "Failed to open file: " << filename << std::endl;
         return false;
     }
     
+    // Bank and subarray the words written so far target; a bank select word
+    // is written whenever an instruction targets another one
+    int currentBank = -1;
+    int currentSubarray = -1;
+    auto selectBank = [&](uint8_t bankId, int subarrayId) {
+        if (bankId == currentBank && (subarrayId < 0 || subarrayId == currentSubarray)) {
+            return;
+        }
+        currentBank = bankId;
+        if (subarrayId >= 0) {
+            currentSubarray = subarrayId;
+        } else if (currentSubarray < 0) {
+            currentSubarray = 0;
+        }
+        uint32_t encodedSelect = encodeBankSelect(bankId, static_cast<uint8_t>(currentSubarray));
+        file.write(reinterpret_cast<const char*>(&encodedSelect), 3);
+    };
+    
     for (const auto &instr : instructions) {
+        // A row clone is issued as a read that opens the source row followed
+        // by the clone word naming the destination row
+        if (instr.type == PIMInstructionType::ROW_CLONE) {
+            PIMInstruction openSource;
+            openSource.type = PIMInstructionType::MEMORY_READ;
+            openSource.address = instr.srcAddress;
+            selectBank(instr.srcBankId, instr.srcSubarrayId);
+            uint32_t encodedSource = encodeInstruction(openSource);
+            file.write(reinterpret_cast<const char*>(&encodedSource), 3);
+        }
+        
+        // Row accesses name a subarray; PROG, EXE, ROUTE and END only a
+        // bank. The scheduler may place other banks' instructions between
+        // an EXE and its END, so END selects its bank too.
+        switch (instr.type) {
+            case PIMInstructionType::PROG:
+            case PIMInstructionType::EXE:
+            case PIMInstructionType::ROUTE:
+            case PIMInstructionType::END:
+                selectBank(instr.bankId, -1);
+                break;
+            default:
+                selectBank(instr.bankId, instr.subarrayId);
+                break;
+        }
+        
         uint32_t encodedInstr = encodeInstruction(instr);
         file.write(reinterpret_cast<const char*>(&encodedInstr), 3); // Write 24 bits
     }
@@ -88,27 +156,75 @@ bool CodeGenerator::savePIMInstructions(const std::vector<PIMInstruction> &instr
 uint32_t CodeGenerator::encodeInstruction(const PIMInstruction &instr) {
     uint32_t encodedInstr = 0;
     
-    // Set instruction type (2 bits)
-    encodedInstr |= (static_cast<uint32_t>(instr.type) & 0x3) << 22;
+    // Set instruction type (2 bits: 00 memory, 01 PROG, 10 EXE, 11 END)
+    uint32_t typeBits = 0;
+    switch (instr.type) {
+        case PIMInstructionType::PROG: typeBits = 1; break;
+        case PIMInstructionType::EXE: typeBits = 2; break;
+        case PIMInstructionType::END: typeBits = 3; break;
+        default: typeBits = 0; break;
+    }
+    encodedInstr |= typeBits << 22;
     
     // Set core ID or opcode (6 bits)
-    if (instr.type == PIMInstructionType::PROG) {
+    if (instr.type == PIMInstructionType::PROG && instr.coreMask) {
+        // A broadcast PROG sets R; the core field holds the clusters and the
+        // row field the cores of each cluster that latch the control word
+        encodedInstr |= (instr.clusterMask & 0x3F) << 16;
+        encodedInstr |= 1 << 15;
+        encodedInstr |= instr.coreMask & 0x1FF;
+    } else if (instr.type == PIMInstructionType::PROG) {
         encodedInstr |= (instr.coreId & 0x3F) << 16;
+    } else if (instr.type == PIMInstructionType::ROUTE) {
+        // A route sets neither R nor W; the core field holds the distance
+        // each receiving cluster takes its partial result from
+        encodedInstr |= (instr.address & 0x3F) << 16;
     } else if (instr.type == PIMInstructionType::EXE) {
         encodedInstr |= (static_cast<uint32_t>(instr.opcode) & 0x3F) << 16;
     }
     
     // Set memory access bits and address
-    if (instr.type == PIMInstructionType::MEMORY_READ) {
+    // Host staging transfers set the host bit; the R/W bit gives the
+    // direction as seen from the DRAM row. A row clone sets both R and W and
+    // copies the open row into the addressed row.
+    if (instr.type == PIMInstructionType::MEMORY_READ || instr.type == PIMInstructionType::HOST_STORE) {
         encodedInstr |= 1 << 15;
-    } else if (instr.type == PIMInstructionType::MEMORY_WRITE) {
+    } else if (instr.type == PIMInstructionType::MEMORY_WRITE || instr.type == PIMInstructionType::HOST_LOAD) {
         encodedInstr |= 1 << 14;
+    } else if (instr.type == PIMInstructionType::ROW_CLONE) {
+        encodedInstr |= (1 << 15) | (1 << 14);
+    }
+    if (instr.type == PIMInstructionType::HOST_LOAD || instr.type == PIMInstructionType::HOST_STORE) {
+        encodedInstr |= 1 << 9;
+    }
+    if (instr.type == PIMInstructionType::MEMORY_READ || instr.type == PIMInstructionType::EXE) {
+        encodedInstr |= (instr.bufferId & 0x3) << 10;
+    }
+    if (instr.type == PIMInstructionType::EXE && instr.repeatCount > 1) {
+        // A repeated EXE sets R and runs on every cluster; the row field
+        // holds the repeat count minus one
+        encodedInstr |= 1 << 15;
+        encodedInstr |= (instr.repeatCount - 1) & 0x1FF;
+    } else if (instr.type == PIMInstructionType::EXE || instr.type == PIMInstructionType::ROUTE) {
+        // EXE and ROUTE have no row; the row field holds the cluster mask
+        encodedInstr |= instr.clusterMask;
+    } else if (instr.type != PIMInstructionType::PROG) {
+        encodedInstr |= instr.address & 0x1FF;
     }
-    encodedInstr |= instr.address & 0x1FF;
     
     return encodedInstr;
 }
 
+uint32_t CodeGenerator::encodeBankSelect(uint8_t bankId, uint8_t subarrayId) {
+    // A memory word with the host bit set and neither R nor W; the core
+    // field holds the bank (below MaxBanks, checked by the caller) and the
+    // row field the subarray
+    uint32_t encodedSelect = 1 << 9;
+    encodedSelect |= (bankId & 0x3F) << 16;
+    encodedSelect |= subarrayId & 0x1FF;
+    return encodedSelect;
+}
+
 void CodeGenerator::printPIMInstruction(const PIMInstruction &instr) {
     uint32_t encodedInstr = encodeInstruction(instr);
     std::cout << "Instruction: 0x" << std::hex << std::setw(6) << std::setfill('0') 
@@ -116,23 +232,273 @@ void CodeGenerator::printPIMInstruction(const PIMInstruction &instr) {
     
     switch (instr.type) {
         case PIMInstructionType::PROG:
-            std::cout << "PROG, Core ID: " << static_cast<int>(instr.coreId);
+            if (instr.coreMask) {
+                std::cout << "PROG, Clusters: ";
+                if (instr.clusterMask) {
+                    std::cout << "0x" << std::hex << static_cast<int>(instr.clusterMask) << std::dec;
+                } else {
+                    std::cout << "all";
+                }
+                std::cout << ", Cores: 0x" << std::hex << instr.coreMask << std::dec;
+            } else {
+                std::cout << "PROG, Core ID: " << static_cast<int>(instr.coreId);
+            }
             break;
         case PIMInstructionType::EXE:
             std::cout << "EXE, Opcode: " << static_cast<int>(instr.opcode);
+            if (instr.clusterMask) {
+                std::cout << ", Clusters: 0x" << std::hex << static_cast<int>(instr.clusterMask) << std::dec;
+            }
+            if (instr.bufferId) {
+                std::cout << ", Buffer: " << static_cast<int>(instr.bufferId);
+            }
+            if (instr.repeatCount > 1) {
+                std::cout << ", Repeat: " << instr.repeatCount;
+            }
             break;
         case PIMInstructionType::END:
             std::cout << "END";
             break;
         case PIMInstructionType::MEMORY_READ:
-            std::cout << "MEMORY_READ, Address: 0x" << std::hex << instr.address << std::dec;
+            std::cout << "MEMORY_READ, Bank: " << static_cast<int>(instr.bankId)
+                      << ", Subarray: " << static_cast<int>(instr.subarrayId)
+                      << ", Address: 0x" << std::hex << instr.address << std::dec;
+            if (instr.bufferId) {
+                std::cout << ", Buffer: " << static_cast<int>(instr.bufferId);
+            }
             break;
         case PIMInstructionType::MEMORY_WRITE:
-            std::cout << "MEMORY_WRITE, Address: 0x" << std::hex << instr.address << std::dec;
+            std::cout << "MEMORY_WRITE, Bank: " << static_cast<int>(instr.bankId)
+                      << ", Subarray: " << static_cast<int>(instr.subarrayId)
+                      << ", Address: 0x" << std::hex << instr.address << std::dec;
+            break;
+        case PIMInstructionType::HOST_LOAD:
+            std::cout << "HOST_LOAD, Bank: " << static_cast<int>(instr.bankId)
+                      << ", Subarray: " << static_cast<int>(instr.subarrayId)
+                      << ", Address: 0x" << std::hex << instr.address << std::dec;
+            break;
+        case PIMInstructionType::HOST_STORE:
+            std::cout << "HOST_STORE, Bank: " << static_cast<int>(instr.bankId)
+                      << ", Subarray: " << static_cast<int>(instr.subarrayId)
+                      << ", Address: 0x" << std::hex << instr.address << std::dec;
+            break;
+        case PIMInstructionType::ROW_CLONE:
+            std::cout << "ROW_CLONE, Bank: " << static_cast<int>(instr.srcBankId)
+                      << ", Subarray: " << static_cast<int>(instr.srcSubarrayId)
+                      << ", Address: 0x" << std::hex << instr.srcAddress << std::dec
+                      << " -> Bank: " << static_cast<int>(instr.bankId)
+                      << ", Subarray: " << static_cast<int>(instr.subarrayId)
+                      << ", Address: 0x" << std::hex << instr.address << std::dec;
+            break;
+        case PIMInstructionType::ROUTE:
+            std::cout << "ROUTE, Bank: " << static_cast<int>(instr.bankId)
+                      << ", Clusters: 0x" << std::hex << static_cast<int>(instr.clusterMask) << std::dec
+                      << ", Distance: " << instr.address;
             break;
     }
     
     std::cout << ")" << std::endl;
 }
 
+InstructionStats CodeGenerator::collectInstructionStats(const std::vector<PIMInstruction> &instructions) {
+    InstructionStats stats;
+    
+    // Row currently open in each bank, as (subarray, row)
+    std::map<uint8_t, std::pair<uint8_t, uint32_t>> openRows;
+    
+    for (const auto &instr : instructions) {
+        switch (instr.type) {
+            case PIMInstructionType::PROG:
+                stats.progCount++;
+                break;
+            case PIMInstructionType::EXE:
+                stats.exeCount++;
+                stats.exeExecutions += instr.repeatCount;
+                break;
+            case PIMInstructionType::END:
+                stats.endCount++;
+                break;
+            case PIMInstructionType::MEMORY_READ:
+            case PIMInstructionType::MEMORY_WRITE: {
+                if (instr.type == PIMInstructionType::MEMORY_READ) {
+                    stats.readCount++;
+                } else {
+                    stats.writeCount++;
+                }
+                
+                // Accessing a row other than the open one requires an activation
+                auto row = std::make_pair(instr.subarrayId, instr.address);
+                auto open = openRows.find(instr.bankId);
+                if (open == openRows.end() || open->second != row) {
+                    stats.rowActivations++;
+                    openRows[instr.bankId] = row;
+                }
+                break;
+            }
+            case PIMInstructionType::HOST_LOAD:
+            case PIMInstructionType::HOST_STORE:
+                // Staging goes through the row buffer, leaving the row open
+                stats.hostTransferCount++;
+                stats.rowActivations++;
+                openRows[instr.bankId] = std::make_pair(instr.subarrayId, instr.address);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                // Both the source and the destination row are activated
+                stats.rowCloneCount++;
+                stats.rowActivations += 2;
+                openRows[instr.srcBankId] = std::make_pair(instr.srcSubarrayId, instr.srcAddress);
+                openRows[instr.bankId] = std::make_pair(instr.subarrayId, instr.address);
+                break;
+            case PIMInstructionType::ROUTE:
+                stats.routeCount++;
+                break;
+        }
+    }
+    
+    return stats;
+}
+
+void CodeGenerator::printInstructionStats(const InstructionStats &stats) {
+    std::cout << "Instruction statistics:" << std::endl;
+    std::cout << "  PROG:            " << stats.progCount << std::endl;
+    std::cout << "  EXE:             " << stats.exeCount << " (" << stats.exeExecutions << " executions)"
+              << std::endl;
+    std::cout << "  END:             " << stats.endCount << std::endl;
+    std::cout << "  MEMORY_READ:     " << stats.readCount << std::endl;
+    std::cout << "  MEMORY_WRITE:    " << stats.writeCount << std::endl;
+    std::cout << "  Host transfers:  " << stats.hostTransferCount << std::endl;
+    std::cout << "  Row clones:      " << stats.rowCloneCount << std::endl;
+    std::cout << "  Routes:          " << stats.routeCount << std::endl;
+    std::cout << "  Row activations: " << stats.rowActivations << std::endl;
+}
+
+void appendRepeatedExe(const PIMInstruction &exe, uint32_t count, std::vector<PIMInstruction> &out) {
+    PIMInstruction exeInst = exe;
+    exeInst.repeatCount = 1;
+    if (exe.clusterMask) {
+        // The row field holds either the mask or the count
+        out.insert(out.end(), count, exeInst);
+        return;
+    }
+    
+    while (count > 0) {
+        exeInst.repeatCount = static_cast<uint16_t>(std::min(count, MaxExeRepeat));
+        out.push_back(exeInst);
+        count -= exeInst.repeatCount;
+    }
+}
+
+std::vector<uint32_t> getProgrammedCores(const PIMInstruction &instr, uint32_t clustersPerRow,
+                                         uint32_t coresPerCluster) {
+    std::vector<uint32_t> cores;
+    if (instr.type != PIMInstructionType::PROG) {
+        return cores;
+    }
+    if (!instr.coreMask) {
+        cores.push_back(instr.coreId);
+        return cores;
+    }
+    
+    for (uint32_t cluster = 0; cluster < clustersPerRow; cluster++) {
+        if (instr.clusterMask && !(instr.clusterMask & (1u << cluster))) {
+            continue;
+        }
+        for (uint32_t core = 0; core < coresPerCluster; core++) {
+            if (instr.coreMask & (1u << core)) {
+                cores.push_back(cluster * coresPerCluster + core);
+            }
+        }
+    }
+    
+    return cores;
+}
+
+std::vector<PIMInstruction> buildProgInstructions(uint32_t bankId, PIMOpcode opcode,
+                                                  const std::vector<uint32_t> &coreIds,
+                                                  uint32_t clustersPerRow, uint32_t coresPerCluster) {
+    std::vector<PIMInstruction> instructions;
+    
+    // Cores without an ID in the encoding are programmed one at a time
+    uint64_t coreMask = 0;
+    for (uint32_t coreId : coreIds) {
+        if (coreId < MaxCoreIds) {
+            coreMask |= 1ull << coreId;
+        } else {
+            PIMInstruction progInst;
+            progInst.type = PIMInstructionType::PROG;
+            progInst.bankId = bankId;
+            progInst.opcode = opcode;
+            progInst.coreId = coreId;
+            instructions.push_back(progInst);
+        }
+    }
+    
+    buildProgInstructions(bankId, opcode, coreMask, clustersPerRow, coresPerCluster, instructions);
+    return instructions;
+}
+
+size_t buildProgInstructions(uint32_t bankId, PIMOpcode opcode, uint64_t coreMask, uint32_t clustersPerRow,
+                             uint32_t coresPerCluster, std::vector<PIMInstruction> &out) {
+    size_t begin = out.size();
+    
+    PIMInstruction progInst;
+    progInst.type = PIMInstructionType::PROG;
+    progInst.bankId = bankId;
+    progInst.opcode = opcode;
+    
+    // The encoding has room for 6 clusters of 9 cores; cores outside of it
+    // are programmed one at a time
+    const uint32_t MaxBroadcastClusters = 6;
+    bool broadcast = clustersPerRow <= MaxBroadcastClusters && coresPerCluster <= 9;
+    uint16_t coreMasks[MaxBroadcastClusters] = {};
+    for (uint32_t coreId = 0; coreId < MaxCoreIds; coreId++) {
+        if (!(coreMask & (1ull << coreId))) {
+            continue;
+        }
+        if (broadcast && coreId < clustersPerRow * coresPerCluster) {
+            coreMasks[coreId / coresPerCluster] |= static_cast<uint16_t>(1u << (coreId % coresPerCluster));
+        } else {
+            progInst.coreId = coreId;
+            out.push_back(progInst);
+        }
+    }
+    
+    // One PROG per distinct core mask, in order of the first cluster using it
+    uint32_t numMasks = broadcast ? clustersPerRow : 0;
+    for (uint32_t cluster = 0; cluster < numMasks; cluster++) {
+        uint16_t clusterCores = coreMasks[cluster];
+        if (!clusterCores) {
+            continue;
+        }
+        
+        uint8_t clusters = 0;
+        uint32_t numClusters = 0;
+        for (uint32_t other = cluster; other < numMasks; other++) {
+            if (coreMasks[other] == clusterCores) {
+                clusters |= static_cast<uint8_t>(1u << other);
+                coreMasks[other] = 0;
+                numClusters++;
+            }
+        }
+        
+        progInst.coreId = 0;
+        progInst.coreMask = 0;
+        progInst.clusterMask = 0;
+        if (numClusters == 1 && !(clusterCores & (clusterCores - 1))) {
+            // A single core needs no broadcast
+            uint32_t core = 0;
+            while (!(clusterCores & (1u << core))) {
+                core++;
+            }
+            progInst.coreId = cluster * coresPerCluster + core;
+        } else {
+            progInst.coreMask = clusterCores;
+            progInst.clusterMask = numClusters == clustersPerRow ? 0 : clusters;
+        }
+        out.push_back(progInst);
+    }
+    
+    return out.size() - begin;
+}
+
 } // namespace ppim
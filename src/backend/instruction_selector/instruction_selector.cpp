@@ -1,203 +1,606 @@
 #include "backend/instruction_selector/instruction_selector.h"
-#include "backend/memory_mapper/memory_mapper.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/PatternMatch.h"
 #include <iostream>
 #include <algorithm>
-#include <unordered_map>
+#include <atomic>
+#include <thread>
 
 namespace ppim {
 
-InstructionSelector::InstructionSelector() {}
+constexpr InstructionSelector::SelectionTable InstructionSelector::buildSelectionTable() {
+    SelectionTable table{};
+    
+    // Binary operators without a LUT function are reported
+    for (unsigned op = llvm::Instruction::BinaryOpsBegin; op < llvm::Instruction::BinaryOpsEnd; op++) {
+        table.patterns[op] = {&InstructionSelector::emitUnsupportedBinaryOp, PIMOpcode::ADD};
+    }
+    
+    table.patterns[llvm::Instruction::Add] = {&InstructionSelector::emitBinaryOp, PIMOpcode::ADD};
+    table.patterns[llvm::Instruction::FAdd] = {&InstructionSelector::emitBinaryOp, PIMOpcode::ADD};
+    table.patterns[llvm::Instruction::Sub] = {&InstructionSelector::emitBinaryOp, PIMOpcode::SUBTRACT};
+    table.patterns[llvm::Instruction::FSub] = {&InstructionSelector::emitBinaryOp, PIMOpcode::SUBTRACT};
+    table.patterns[llvm::Instruction::Mul] = {&InstructionSelector::emitBinaryOp, PIMOpcode::MULTIPLY};
+    table.patterns[llvm::Instruction::FMul] = {&InstructionSelector::emitBinaryOp, PIMOpcode::MULTIPLY};
+    table.patterns[llvm::Instruction::Shl] = {&InstructionSelector::emitBinaryOp, PIMOpcode::SHIFT_LEFT};
+    table.patterns[llvm::Instruction::LShr] = {&InstructionSelector::emitBinaryOp, PIMOpcode::SHIFT_RIGHT_LOGICAL};
+    table.patterns[llvm::Instruction::AShr] = {&InstructionSelector::emitBinaryOp, PIMOpcode::SHIFT_RIGHT_ARITHMETIC};
+    table.patterns[llvm::Instruction::And] = {&InstructionSelector::emitBinaryOp, PIMOpcode::AND};
+    table.patterns[llvm::Instruction::Or] = {&InstructionSelector::emitBinaryOp, PIMOpcode::OR};
+    table.patterns[llvm::Instruction::Xor] = {&InstructionSelector::emitBinaryOp, PIMOpcode::XOR};
+    table.patterns[llvm::Instruction::Select] = {&InstructionSelector::emitSelect, PIMOpcode::RELU};
+    table.patterns[llvm::Instruction::Load] = {&InstructionSelector::emitLoad, PIMOpcode::ADD};
+    table.patterns[llvm::Instruction::Store] = {&InstructionSelector::emitStore, PIMOpcode::ADD};
+    table.patterns[llvm::Instruction::Call] = {&InstructionSelector::emitCall, PIMOpcode::MAC};
+    
+    return table;
+}
+
+// Constant-initialized, so the table is built by the compiler
+const InstructionSelector::SelectionTable InstructionSelector::PatternTable =
+    InstructionSelector::buildSelectionTable();
+
+InstructionSelector::InstructionSelector()
+    : MemMapper(nullptr), NumThreads(1), ClustersPerRow(4), CoresPerCluster(9) {
+    resetLUTState();
+}
+
+bool InstructionSelector::initialize(uint32_t clustersPerRow, uint32_t coresPerCluster) {
+    // Clusters beyond the cluster masks or cores beyond the core IDs would
+    // be dropped when encoded
+    if (clustersPerRow == 0 || clustersPerRow > MaxClustersPerRow || coresPerCluster == 0 ||
+        clustersPerRow * coresPerCluster > MaxCoreIds) {
+        std::cerr << "Error: Unsupported geometry of " << clustersPerRow << " clusters per row and "
+                  << coresPerCluster << " cores per cluster" << std::endl;
+        return false;
+    }
+    
+    ClustersPerRow = clustersPerRow;
+    CoresPerCluster = coresPerCluster;
+    return true;
+}
 
 std::vector<PIMInstruction> InstructionSelector::selectInstructions(llvm::Instruction* inst) {
+    std::vector<PIMInstruction> instructions;
+    selectInstructions(inst, instructions);
+    return instructions;
+}
+
+void InstructionSelector::selectInstructions(llvm::Instruction* inst, std::vector<PIMInstruction>& out) {
     if (!inst) {
         std::cerr << "Invalid instruction" << std::endl;
-        return {};
+        return;
     }
     
-    // Select instructions based on the instruction type
-    if (llvm::BinaryOperator* binOp = llvm::dyn_cast<llvm::BinaryOperator>(inst)) {
-        return selectForBinaryOp(binOp);
-    } else if (llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(inst)) {
-        return selectForLoad(load);
-    } else if (llvm::StoreInst* store = llvm::dyn_cast<llvm::StoreInst>(inst)) {
-        return selectForStore(store);
-    } else if (llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(inst)) {
-        return selectForCall(call);
+    // Dispatch on the opcode; unsupported instructions select to nothing
+    const SelectionPattern& pattern = PatternTable.patterns[inst->getOpcode()];
+    if (pattern.emit) {
+        (this->*pattern.emit)(inst, pattern.opcode, out);
     }
-    
-    // Default: return empty vector for unsupported instructions
-    return {};
 }
 
 std::vector<PIMInstruction> InstructionSelector::selectInstructionsForBasicBlock(llvm::BasicBlock& bb) {
     std::vector<PIMInstruction> instructions;
-    
-    // Select instructions for each instruction in the basic block
-    for (auto& inst : bb) {
-        auto instInstructions = selectInstructions(&inst);
-        instructions.insert(instructions.end(), instInstructions.begin(), instInstructions.end());
-    }
-    
+    instructions.reserve(bb.size());
+    selectBasicBlock(bb, instructions);
     return instructions;
 }
 
 std::vector<PIMInstruction> InstructionSelector::selectInstructionsForFunction(llvm::Function& func) {
     std::vector<PIMInstruction> instructions;
     
-    // Select instructions for each basic block in the function
+    // Nothing is known about the cores when a function starts
+    resetLUTState();
+    
+    // Most instructions select to at most one pPIM instruction
+    size_t numInstructions = 0;
     for (auto& bb : func) {
-        auto bbInstructions = selectInstructionsForBasicBlock(bb);
-        instructions.insert(instructions.end(), bbInstructions.begin(), bbInstructions.end());
+        numInstructions += bb.size();
+    }
+    instructions.reserve(numInstructions);
+    
+    // Select instructions for each basic block in the function
+    if (NumThreads == 1) {
+        for (auto& bb : func) {
+            enterBlockLUTState(bb);
+            selectBasicBlock(bb, instructions);
+            leaveBlockLUTState(bb);
+        }
+    } else {
+        std::vector<llvm::BasicBlock*> blocks;
+        for (auto& bb : func) {
+            blocks.push_back(&bb);
+        }
+        selectBlocksInParallel(blocks, instructions);
     }
     
     return instructions;
 }
 
-std::vector<PIMInstruction> InstructionSelector::selectForBinaryOp(llvm::BinaryOperator* binOp) {
+std::vector<PIMInstruction> InstructionSelector::selectInstructionsForModule(llvm::Module& module) {
+    if (NumThreads == 1) {
+        std::vector<PIMInstruction> instructions;
+        for (auto& func : module) {
+            auto funcInstructions = selectInstructionsForFunction(func);
+            instructions.insert(instructions.end(), funcInstructions.begin(), funcInstructions.end());
+        }
+        return instructions;
+    }
+    
+    // Select the blocks of all functions on one pool
+    std::vector<llvm::BasicBlock*> blocks;
+    for (auto& func : module) {
+        for (auto& bb : func) {
+            blocks.push_back(&bb);
+        }
+    }
+    
     std::vector<PIMInstruction> instructions;
+    resetLUTState();
+    selectBlocksInParallel(blocks, instructions);
+    return instructions;
+}
+
+void InstructionSelector::selectBlocksInParallel(const std::vector<llvm::BasicBlock*>& blocks,
+                                                 std::vector<PIMInstruction>& out) {
+    unsigned numThreads = NumThreads ? NumThreads : std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min<size_t>(numThreads, std::max<size_t>(blocks.size(), 1));
     
-    // Determine the operation type
-    PIMOpcode opcode;
-    switch (binOp->getOpcode()) {
-        case llvm::Instruction::Add:
-        case llvm::Instruction::FAdd:
-            opcode = PIMOpcode::ADD;
-            break;
-        case llvm::Instruction::Mul:
-        case llvm::Instruction::FMul:
-            opcode = PIMOpcode::MULTIPLY;
-            break;
-        default:
-            // Unsupported operation
-            std::cerr << "Unsupported binary operation: " << binOp->getOpcodeName() << std::endl;
-            return {};
+    // Each block is selected as if no core had been programmed, so a block's
+    // output only depends on the block itself. The PROGs this adds are
+    // removed when the buffers are merged.
+    std::vector<std::vector<PIMInstruction>> buffers(blocks.size());
+    std::vector<LUTProgrammingStats> workerStats(numThreads);
+    std::atomic<size_t> nextBlock(0);
+    
+    // Idle workers take the next unselected block, so long blocks do not
+    // hold up the others
+    auto worker = [&](unsigned workerId) {
+        InstructionSelector selector;
+        selector.setMemoryMapper(MemMapper);
+        selector.initialize(ClustersPerRow, CoresPerCluster);
+        for (size_t i = nextBlock++; i < blocks.size(); i = nextBlock++) {
+            selector.resetLUTState();
+            buffers[i].reserve(blocks[i]->size());
+            selector.selectBasicBlock(*blocks[i], buffers[i]);
+        }
+        workerStats[workerId] = selector.getLUTProgrammingStats();
+    };
+    
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker, t);
     }
+    worker(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    for (const auto& stats : workerStats) {
+        LUTStats.progRequested += stats.progRequested;
+    }
+    
+    // Concatenate in program order, replaying the LUT state of the serial
+    // path, block entries included, to drop PROGs for cores that already
+    // hold the function
+    size_t total = out.size();
+    for (const auto& buffer : buffers) {
+        total += buffer.size();
+    }
+    out.reserve(total);
+    
+    for (size_t i = 0; i < blocks.size(); i++) {
+        enterBlockLUTState(*blocks[i]);
+        for (const PIMInstruction& inst : buffers[i]) {
+            if (inst.type == PIMInstructionType::PROG) {
+                // Re-broadcast to the cores that still need the function
+                std::vector<uint32_t> cores = getProgrammedCores(inst, ClustersPerRow, CoresPerCluster);
+                std::vector<uint32_t> stale;
+                for (uint32_t coreId : cores) {
+                    if (coreId >= MaxCores || CoreLUTState[coreId] != static_cast<int>(inst.opcode)) {
+                        stale.push_back(coreId);
+                    }
+                }
+                if (stale.size() == cores.size()) {
+                    out.push_back(inst);
+                    LUTStats.progEmitted++;
+                } else if (!stale.empty()) {
+                    auto progInstructions = buildProgInstructions(inst.bankId, inst.opcode, stale, ClustersPerRow,
+                                                                  CoresPerCluster);
+                    out.insert(out.end(), progInstructions.begin(), progInstructions.end());
+                    LUTStats.progEmitted += progInstructions.size();
+                }
+                LUTStats.coresProgrammed += stale.size();
+                for (uint32_t coreId : stale) {
+                    if (coreId < MaxCores) {
+                        CoreLUTState[coreId] = static_cast<int>(inst.opcode);
+                    }
+                }
+                continue;
+            }
+            out.push_back(inst);
+        }
+        leaveBlockLUTState(*blocks[i]);
+    }
+}
+
+void InstructionSelector::selectBasicBlock(llvm::BasicBlock& bb, std::vector<PIMInstruction>& out) {
+    size_t begin = out.size();
     
+    // Match add(x, mul(a, b)) chains first. Walking backwards visits the
+    // last add of a chain before the adds and multiplies it absorbs.
+    ChainProducts.clear();
+    Absorbed.clear();
+    for (auto it = bb.rbegin(); it != bb.rend(); ++it) {
+        llvm::BinaryOperator* binOp = llvm::dyn_cast<llvm::BinaryOperator>(&*it);
+        if (!binOp || Absorbed.count(binOp)) {
+            continue;
+        }
+        
+        MACChain chain;
+        PendingAbsorbed.clear();
+        if (matchMACChain(binOp, chain)) {
+            Absorbed.insert(PendingAbsorbed.begin(), PendingAbsorbed.end());
+            ChainProducts[binOp] = chain.numProducts;
+        }
+    }
+    
+    // Select instructions for each instruction in the basic block, emitting
+    // each chain in place of its last add
+    for (auto& inst : bb) {
+        if (!ChainProducts.empty()) {
+            auto chain = ChainProducts.find(&inst);
+            if (chain != ChainProducts.end()) {
+                emitMACChain(chain->second, out);
+                continue;
+            }
+            if (Absorbed.count(&inst)) {
+                continue;
+            }
+        }
+        selectInstructions(&inst, out);
+    }
+    
+    coalesceRowAccesses(out, begin);
+}
+
+void InstructionSelector::resetLUTState() {
+    std::fill(CoreLUTState, CoreLUTState + MaxCores, -1);
+    BlockExitLUTState.clear();
+}
+
+void InstructionSelector::enterBlockLUTState(const llvm::BasicBlock& bb) {
+    // Blocks are selected in layout order, so a predecessor not selected yet
+    // (a loop back edge) leaves unknown contents, as does entering the function
+    bool first = true;
+    for (const llvm::BasicBlock* pred : llvm::predecessors(&bb)) {
+        auto exitState = BlockExitLUTState.find(pred);
+        if (exitState == BlockExitLUTState.end()) {
+            first = true;
+            break;
+        }
+        for (uint32_t core = 0; core < MaxCores; core++) {
+            if (first) {
+                CoreLUTState[core] = exitState->second[core];
+            } else if (CoreLUTState[core] != exitState->second[core]) {
+                CoreLUTState[core] = -1;
+            }
+        }
+        first = false;
+    }
+    if (first) {
+        std::fill(CoreLUTState, CoreLUTState + MaxCores, -1);
+    }
+}
+
+void InstructionSelector::leaveBlockLUTState(const llvm::BasicBlock& bb) {
+    BlockExitLUTState[&bb].assign(CoreLUTState, CoreLUTState + MaxCores);
+}
+
+void InstructionSelector::emitBinaryOp(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out) {
     // Check if the operation can be vectorized
-    if (binOp->getType()->isVectorTy()) {
+    if (llvm::FixedVectorType* vectorType = llvm::dyn_cast<llvm::FixedVectorType>(inst->getType())) {
         // Generate SIMD instructions
-        int vectorSize = binOp->getType()->getVectorNumElements();
-        return generateSIMDInstructions(opcode, vectorSize);
+        emitSIMD(opcode, vectorType->getNumElements(), vectorType->getScalarSizeInBits(), out);
+    } else if (inst->getType()->isVectorTy()) {
+        std::cerr << "Unsupported scalable vector operation: " << inst->getOpcodeName() << std::endl;
     } else {
-        // Generate LUT programming instructions
-        auto progInstructions = generateLUTProgrammingInstructions(opcode);
-        instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
-        
-        // Generate EXE instruction
-        PIMInstruction exeInst;
-        exeInst.type = PIMInstructionType::EXE;
-        exeInst.opcode = opcode;
-        instructions.push_back(exeInst);
-        
-        // Generate END instruction
-        PIMInstruction endInst;
-        endInst.type = PIMInstructionType::END;
-        instructions.push_back(endInst);
+        emitLUTProgramming(opcode, out);
+        emitCompute(opcode, 1, out);
     }
-    
-    return instructions;
 }
 
-std::vector<PIMInstruction> InstructionSelector::selectForLoad(llvm::LoadInst* load) {
-    std::vector<PIMInstruction> instructions;
+void InstructionSelector::emitUnaryOp(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out) {
+    // Single-input operations only use the first operand, so they lower like
+    // a binary operation
+    emitBinaryOp(inst, opcode, out);
+}
+
+void InstructionSelector::emitSelect(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out) {
+    // Only max(x, 0) has a LUT; other selects stay on the host. The compare
+    // feeding the select selects to nothing.
+    if (matchReLU(inst)) {
+        emitUnaryOp(inst, opcode, out);
+    }
+}
+
+bool InstructionSelector::matchReLU(llvm::Instruction* inst) {
+    using namespace llvm::PatternMatch;
     
-    // Generate memory read instruction
-    uint32_t address = 0; // In a real implementation, this would be determined by the memory mapper
-    PIMInstruction readInst = generateMemoryAccessInstruction(true, address);
-    instructions.push_back(readInst);
+    // m_c_SMax covers the smax intrinsic and the icmp sgt/sge + select forms,
+    // with the operands in either order and splat zeros for vectors
+    llvm::Value* input = nullptr;
+    return inst->getType()->isIntOrIntVectorTy() && match(inst, m_c_SMax(m_Value(input), m_Zero()));
+}
+
+void InstructionSelector::emitUnsupportedBinaryOp(llvm::Instruction* inst, PIMOpcode,
+                                                  std::vector<PIMInstruction>&) {
+    std::cerr << "Unsupported binary operation: " << inst->getOpcodeName() << std::endl;
+}
+
+bool InstructionSelector::matchMACChain(llvm::BinaryOperator* root, MACChain& chain) {
+    // Only scalar adds start a chain
+    if (root->getType()->isVectorTy() || !collectMACTerms(root, root->getParent(), true, chain)) {
+        return false;
+    }
     
-    return instructions;
+    return chain.numProducts > 0;
 }
 
-std::vector<PIMInstruction> InstructionSelector::selectForStore(llvm::StoreInst* store) {
-    std::vector<PIMInstruction> instructions;
+bool InstructionSelector::collectMACTerms(llvm::Value* value, llvm::BasicBlock* bb, bool isRoot, MACChain& chain) {
+    llvm::BinaryOperator* binOp = llvm::dyn_cast<llvm::BinaryOperator>(value);
+    
+    // Anything other than an add or multiply computed only for this chain
+    // is the accumulator input; a chain has at most one
+    bool ownedByChain = binOp && binOp->getParent() == bb && (isRoot || binOp->hasOneUse());
+    
+    // Floating-point operations are only fused when contraction is allowed
+    bool fusible = ownedByChain &&
+                   (binOp->getType()->isIntegerTy() ||
+                    (binOp->getType()->isFloatingPointTy() && binOp->hasAllowContract()));
+    
+    if (fusible && (binOp->getOpcode() == llvm::Instruction::Add ||
+                    binOp->getOpcode() == llvm::Instruction::FAdd)) {
+        // An add that does not reduce to a chain is kept as the accumulator
+        // input, so roll back whatever its operands added to the chain
+        MACChain saved = chain;
+        size_t savedAbsorbed = PendingAbsorbed.size();
+        if (collectMACTerms(binOp->getOperand(0), bb, false, chain) &&
+            collectMACTerms(binOp->getOperand(1), bb, false, chain)) {
+            PendingAbsorbed.push_back(binOp);
+            return true;
+        }
+        chain = saved;
+        PendingAbsorbed.resize(savedAbsorbed);
+    }
     
+    if (fusible && !isRoot && (binOp->getOpcode() == llvm::Instruction::Mul ||
+                               binOp->getOpcode() == llvm::Instruction::FMul)) {
+        chain.numProducts++;
+        PendingAbsorbed.push_back(binOp);
+        return true;
+    }
+    
+    if (isRoot || chain.accumulator) {
+        return false;
+    }
+    chain.accumulator = value;
+    return true;
+}
+
+void InstructionSelector::emitMACChain(uint32_t numProducts, std::vector<PIMInstruction>& out) {
+    // Program the MAC LUTs once for the whole chain. One EXE accumulates each
+    // product into the running sum, which starts from the accumulator input
+    // (or zero).
+    emitLUTProgramming(PIMOpcode::MAC, out);
+    emitCompute(PIMOpcode::MAC, numProducts, out);
+}
+
+void InstructionSelector::emitLoad(llvm::Instruction* inst, PIMOpcode, std::vector<PIMInstruction>& out) {
+    // Generate memory read instruction
+    llvm::LoadInst* load = llvm::cast<llvm::LoadInst>(inst);
+    emitMemoryAccess(true, resolveAddress(load->getPointerOperand(), load->getModule()->getDataLayout()), out);
+}
+
+void InstructionSelector::emitStore(llvm::Instruction* inst, PIMOpcode, std::vector<PIMInstruction>& out) {
     // Generate memory write instruction
-    uint32_t address = 0; // In a real implementation, this would be determined by the memory mapper
-    PIMInstruction writeInst = generateMemoryAccessInstruction(false, address);
-    instructions.push_back(writeInst);
+    llvm::StoreInst* store = llvm::cast<llvm::StoreInst>(inst);
+    emitMemoryAccess(false, resolveAddress(store->getPointerOperand(), store->getModule()->getDataLayout()), out);
+}
+
+PhysicalMemoryLocation InstructionSelector::resolveAddress(llvm::Value* ptr, const llvm::DataLayout& dataLayout) {
+    // Without a memory mapper every access goes to row 0
+    if (!MemMapper) {
+        return PhysicalMemoryLocation();
+    }
     
-    return instructions;
+    // Walk back through GEPs and casts to the mapped global or alloca,
+    // accumulating constant offsets in bytes
+    llvm::APInt offset(dataLayout.getIndexTypeSizeInBits(ptr->getType()), 0);
+    llvm::Value* base = ptr->stripAndAccumulateConstantOffsets(dataLayout, offset, true);
+    if (!MemMapper->isValueMapped(base)) {
+        // A variable index stops the walk early; fall back to the start of the
+        // underlying object
+        while (llvm::GEPOperator* gep = llvm::dyn_cast<llvm::GEPOperator>(base)) {
+            base = gep->getPointerOperand()->stripPointerCasts();
+        }
+        offset = 0;
+        if (!MemMapper->isValueMapped(base)) {
+            std::cerr << "Warning: Unmapped memory access to " << base->getName().str() << std::endl;
+            return PhysicalMemoryLocation();
+        }
+    }
+    
+    PhysicalMemoryLocation location = MemMapper->getValueLocation(base);
+    if (offset.isNegative()) {
+        return location;
+    }
+    return MemMapper->offsetLocation(location, offset.getZExtValue());
 }
 
-std::vector<PIMInstruction> InstructionSelector::selectForCall(llvm::CallInst* call) {
-    std::vector<PIMInstruction> instructions;
+void InstructionSelector::coalesceRowAccesses(std::vector<PIMInstruction>& instructions, size_t begin) {
+    // Compact in place; out never overtakes i
+    size_t out = begin;
+    size_t runStart = begin;
+    for (size_t i = begin; i < instructions.size(); i++) {
+        const PIMInstruction& inst = instructions[i];
+        bool isAccess = inst.type == PIMInstructionType::MEMORY_READ ||
+                        inst.type == PIMInstructionType::MEMORY_WRITE;
+        
+        // A run is a sequence of reads, or of writes, with nothing in between
+        if (!isAccess) {
+            instructions[out++] = inst;
+            runStart = out;
+            continue;
+        }
+        if (out > runStart && instructions[out - 1].type != inst.type) {
+            runStart = out;
+        }
+        
+        // Keep only the first access to each row within the run
+        bool duplicate = false;
+        for (size_t j = runStart; j < out; j++) {
+            if (instructions[j].bankId == inst.bankId && instructions[j].subarrayId == inst.subarrayId &&
+                instructions[j].address == inst.address) {
+                duplicate = true;
+                break;
+            }
+        }
+        if (!duplicate) {
+            instructions[out++] = inst;
+        }
+    }
+    
+    instructions.resize(out);
+}
+
+void InstructionSelector::emitCall(llvm::Instruction* inst, PIMOpcode opcode, std::vector<PIMInstruction>& out) {
+    // smax(x, 0) is a ReLU
+    if (matchReLU(inst)) {
+        emitUnaryOp(inst, PIMOpcode::RELU, out);
+        return;
+    }
     
     // Check if the call is to a known function
-    llvm::Function* calledFunc = call->getCalledFunction();
+    llvm::Function* calledFunc = llvm::cast<llvm::CallInst>(inst)->getCalledFunction();
     if (!calledFunc) {
-        return {};
+        return;
     }
     
-    std::string funcName = calledFunc->getName().str();
+    llvm::StringRef funcName = calledFunc->getName();
     
     // Handle matrix multiplication function
-    if (funcName == "matrix_mult" || funcName.find("matrix_multiply") != std::string::npos) {
+    if (funcName == "matrix_mult" || funcName.contains("matrix_multiply")) {
         // Generate instructions for matrix multiplication
         // This would involve generating the 8-stage MAC operation as shown in Fig. 6
-        
-        // 1. Generate LUT programming instructions for MAC
-        auto progInstructions = generateLUTProgrammingInstructions(PIMOpcode::MAC);
-        instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
-        
-        // 2. Generate EXE instruction for MAC
-        PIMInstruction exeInst;
-        exeInst.type = PIMInstructionType::EXE;
-        exeInst.opcode = PIMOpcode::MAC;
-        instructions.push_back(exeInst);
-        
-        // 3. Generate END instruction
-        PIMInstruction endInst;
-        endInst.type = PIMInstructionType::END;
-        instructions.push_back(endInst);
+        emitLUTProgramming(opcode, out);
+        emitCompute(opcode, 1, out);
     }
     // Handle other known functions as needed
-    
-    return instructions;
 }
 
-std::vector<PIMInstruction> InstructionSelector::generateLUTProgrammingInstructions(PIMOpcode opcode) {
-    std::vector<PIMInstruction> instructions;
-    
-    // Determine which cores to program based on the operation
-    std::vector<uint8_t> coresToProgram;
+void InstructionSelector::getLaneCores(PIMOpcode opcode, uint32_t elementBytes, uint32_t& firstCore,
+                                       uint32_t& lastCore) {
+    // An element of n bytes takes one core per byte. Operations whose bytes
+    // interact need extra cores after them; for 32-bit operands this gives
+    // the layout of the scalar path.
+    uint32_t bytes = std::max(1u, elementBytes);
+    uint32_t adders = bytes > 1 ? bytes + 1 : 1;
     switch (opcode) {
         case PIMOpcode::ADD:
-            // For addition, program cores 0-4 as adders
-            for (uint8_t i = 0; i < 5; i++) {
-                coresToProgram.push_back(i);
-            }
+        case PIMOpcode::SUBTRACT:
+            // For addition and subtraction, program one adder per byte plus
+            // one core merging the carries (cores 0-4 for i32); subtraction
+            // uses LUTs that add the complement
+            firstCore = 0;
+            lastCore = adders - 1;
+            break;
+        case PIMOpcode::SHIFT_LEFT:
+        case PIMOpcode::SHIFT_RIGHT_LOGICAL:
+        case PIMOpcode::SHIFT_RIGHT_ARITHMETIC:
+            // For shifts, program one core per byte plus one core merging
+            // the bits shifted across byte boundaries (cores 0-4 for i32)
+            firstCore = 0;
+            lastCore = adders - 1;
+            break;
+        case PIMOpcode::AND:
+        case PIMOpcode::OR:
+        case PIMOpcode::XOR:
+            // For bitwise operations, program one core per byte (cores 0-3
+            // for i32); no carries cross bytes
+            firstCore = 0;
+            lastCore = bytes - 1;
             break;
         case PIMOpcode::MULTIPLY:
-            // For multiplication, program cores 5-8 as multipliers
-            for (uint8_t i = 5; i < 9; i++) {
-                coresToProgram.push_back(i);
-            }
+            // For multiplication, program the multipliers after the adders
+            // (cores 5-8 for i32)
+            firstCore = adders;
+            lastCore = adders + bytes - 1;
             break;
         case PIMOpcode::MAC:
-            // For MAC, program all cores (0-8)
-            for (uint8_t i = 0; i < 9; i++) {
-                coresToProgram.push_back(i);
-            }
+            // For MAC, program the adders and the multipliers (cores 0-8 for i32)
+            firstCore = 0;
+            lastCore = adders + bytes - 1;
             break;
         case PIMOpcode::RELU:
             // For ReLU, program core 0
-            coresToProgram.push_back(0);
+            firstCore = 0;
+            lastCore = 0;
             break;
     }
+}
+
+void InstructionSelector::emitLUTProgramming(PIMOpcode opcode, std::vector<PIMInstruction>& out) {
+    // Scalar operations work on 32-bit operands
+    uint32_t firstCore = 0;
+    uint32_t lastCore = 0;
+    getLaneCores(opcode, 4, firstCore, lastCore);
     
-    // Generate PROG instructions for each core
-    for (uint8_t coreId : coresToProgram) {
-        PIMInstruction progInst;
-        progInst.type = PIMInstructionType::PROG;
-        progInst.coreId = coreId;
-        instructions.push_back(progInst);
+    // Generate PROG instructions for the cores whose LUTs hold another function
+    uint64_t coreMask = ((1ull << (lastCore + 1)) - 1) & ~((1ull << firstCore) - 1);
+    programCores(coreMask, opcode, out);
+}
+
+void InstructionSelector::programCores(uint64_t coreMask, PIMOpcode opcode, std::vector<PIMInstruction>& out) {
+    uint64_t staleMask = 0;
+    uint32_t numStale = 0;
+    for (uint32_t coreId = 0; coreId < MaxCores; coreId++) {
+        if (!(coreMask & (1ull << coreId))) {
+            continue;
+        }
+        LUTStats.progRequested++;
+        if (CoreLUTState[coreId] != static_cast<int>(opcode)) {
+            staleMask |= 1ull << coreId;
+            numStale++;
+            CoreLUTState[coreId] = static_cast<int>(opcode);
+        }
+    }
+    if (!staleMask) {
+        return;
     }
     
-    return instructions;
+    LUTStats.progEmitted += buildProgInstructions(0, opcode, staleMask, ClustersPerRow, CoresPerCluster, out);
+    LUTStats.coresProgrammed += numStale;
+}
+
+void InstructionSelector::emitCompute(PIMOpcode opcode, uint32_t numExecutions, std::vector<PIMInstruction>& out) {
+    PIMInstruction exeInst;
+    exeInst.type = PIMInstructionType::EXE;
+    exeInst.opcode = opcode;
+    appendRepeatedExe(exeInst, numExecutions, out);
+    
+    // Generate END instruction
+    PIMInstruction endInst;
+    endInst.type = PIMInstructionType::END;
+    out.push_back(endInst);
 }
 
-PIMInstruction InstructionSelector::generateMemoryAccessInstruction(bool isRead, uint32_t address) {
+void InstructionSelector::emitMemoryAccess(bool isRead, const PhysicalMemoryLocation& location,
+                                           std::vector<PIMInstruction>& out) {
     PIMInstruction inst;
     
     if (isRead) {
@@ -206,31 +609,58 @@ PIMInstruction InstructionSelector::generateMemoryAccessInstruction(bool isRead,
         inst.type = PIMInstructionType::MEMORY_WRITE;
     }
     
-    inst.address = address & 0x1FF; // 9-bit row address
+    inst.bankId = location.bankId;
+    inst.subarrayId = location.subarrayId;
+    inst.address = location.rowAddress & 0x1FF; // 9-bit row address
     
-    return inst;
+    out.push_back(inst);
 }
 
-std::vector<PIMInstruction> InstructionSelector::generateSIMDInstructions(PIMOpcode opcode, int vectorSize) {
-    std::vector<PIMInstruction> instructions;
+void InstructionSelector::emitSIMD(PIMOpcode opcode, uint32_t numElements, uint32_t elementBits,
+                                   std::vector<PIMInstruction>& out) {
+    // Carries cannot cross clusters, so every lane lies within one cluster
+    // and uses the cores the scalar path would for an element of its width
+    if (numElements == 0) {
+        return;
+    }
+    uint32_t firstCore = 0;
+    uint32_t lastCore = 0;
+    getLaneCores(opcode, (elementBits + 7) / 8, firstCore, lastCore);
+    uint32_t laneCores = lastCore + 1;
+    uint32_t lanesPerCluster = std::max(1u, CoresPerCluster / laneCores);
+    uint32_t lanes = lanesPerCluster * ClustersPerRow;
     
-    // Generate LUT programming instructions
-    auto progInstructions = generateLUTProgrammingInstructions(opcode);
-    instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
+    // Program the cores of every lane in use, lane l of a cluster starting
+    // at core l * laneCores
+    uint32_t lanesUsed = std::min(numElements, lanes);
+    uint64_t coreMask = 0;
+    for (uint32_t lane = 0; lane < lanesUsed; lane++) {
+        uint32_t base = (lane / lanesPerCluster) * CoresPerCluster + (lane % lanesPerCluster) * laneCores;
+        for (uint32_t core = firstCore; core <= lastCore && core < CoresPerCluster; core++) {
+            coreMask |= 1ull << (base + core);
+        }
+    }
+    programCores(coreMask, opcode, out);
     
-    // Generate EXE instruction with SIMD flag
+    // One execution per full group of lanes on all clusters, as a repeated EXE
     PIMInstruction exeInst;
     exeInst.type = PIMInstructionType::EXE;
     exeInst.opcode = opcode;
-    // In a real implementation, we would set a SIMD flag or use a special opcode
-    instructions.push_back(exeInst);
+    appendRepeatedExe(exeInst, numElements / lanes, out);
+    
+    // The remainder runs on the clusters its lanes occupy
+    uint32_t remainder = numElements % lanes;
+    if (remainder) {
+        uint32_t remainderClusters = (remainder + lanesPerCluster - 1) / lanesPerCluster;
+        exeInst.clusterMask = remainderClusters < ClustersPerRow ?
+                              static_cast<uint8_t>((1u << remainderClusters) - 1) : 0;
+        out.push_back(exeInst);
+    }
     
     // Generate END instruction
     PIMInstruction endInst;
     endInst.type = PIMInstructionType::END;
-    instructions.push_back(endInst);
-    
-    return instructions;
+    out.push_back(endInst);
 }
 
 } // namespace ppim
@@ -0,0 +1,355 @@
+#include "backend/memory_mapper/memory_map_exporter.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace ppim {
+
+namespace {
+
+// Escape a string for use inside a JSON string literal
+std::string escapeJSON(const std::string &text) {
+    std::ostringstream escaped;
+    for (char c : text) {
+        switch (c) {
+            case '"': escaped << "\\\""; break;
+            case '\\': escaped << "\\\\"; break;
+            case '\n': escaped << "\\n"; break;
+            case '\t': escaped << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                            << static_cast<int>(c) << std::dec;
+                } else {
+                    escaped << c;
+                }
+                break;
+        }
+    }
+    return escaped.str();
+}
+
+// Quote a CSV field if it contains separators or quotes
+std::string escapeCSV(const std::string &text) {
+    if (text.find_first_of(",\"\n") == std::string::npos) {
+        return text;
+    }
+    
+    std::string quoted = "\"";
+    for (char c : text) {
+        quoted += c;
+        if (c == '"') {
+            quoted += '"';
+        }
+    }
+    return quoted + "\"";
+}
+
+void writeLocationJSON(std::ostream &out, const PhysicalMemoryLocation &location) {
+    out << "{\"bank\": " << location.bankId << ", \"subarray\": " << location.subarrayId
+        << ", \"row\": " << location.rowAddress << ", \"column\": " << location.columnOffset << "}";
+}
+
+void writeLocationCSV(std::ostream &out, const PhysicalMemoryLocation &location) {
+    out << location.bankId << "," << location.subarrayId << ","
+        << location.rowAddress << "," << location.columnOffset;
+}
+
+// Name of an LLVM value, or its address if it is unnamed
+std::string getValueName(const llvm::Value *value) {
+    if (value->hasName()) {
+        return value->getName().str();
+    }
+    
+    std::ostringstream name;
+    name << "value@" << static_cast<const void*>(value);
+    return name.str();
+}
+
+} // namespace
+
+MemoryMapExporter::MemoryMapExporter(const MemoryMapper &memMapper) : Mapper(memMapper) {
+    uint32_t numSubarrays = Mapper.getNumBanks() * Mapper.getNumSubarraysPerBank();
+    SubarrayAccesses.assign(numSubarrays, SubarrayAccessStats());
+    ClusterAccesses.assign(numSubarrays * Mapper.getNumClustersPerSubarray(), 0);
+    RowsTouched.assign(numSubarrays, std::vector<bool>(Mapper.getNumRowsPerSubarray(), false));
+}
+
+void MemoryMapExporter::recordAccesses(const std::vector<PIMInstruction> &instructions) {
+    for (const auto &instr : instructions) {
+        switch (instr.type) {
+            case PIMInstructionType::MEMORY_READ:
+            case PIMInstructionType::HOST_STORE:
+                recordAccess(instr.bankId, instr.subarrayId, instr.address, false);
+                break;
+            case PIMInstructionType::MEMORY_WRITE:
+            case PIMInstructionType::HOST_LOAD:
+                recordAccess(instr.bankId, instr.subarrayId, instr.address, true);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                recordAccess(instr.srcBankId, instr.srcSubarrayId, instr.srcAddress, false);
+                recordAccess(instr.bankId, instr.subarrayId, instr.address, true);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void MemoryMapExporter::recordAccess(uint32_t bankId, uint32_t subarrayId, uint32_t row, bool isWrite) {
+    uint32_t subarray = bankId * Mapper.getNumSubarraysPerBank() + subarrayId;
+    if (subarray >= SubarrayAccesses.size() || row >= Mapper.getNumRowsPerSubarray()) {
+        std::cerr << "Warning: Access outside the device at bank " << bankId
+                  << ", subarray " << subarrayId << ", row " << row << std::endl;
+        return;
+    }
+    
+    SubarrayAccessStats &stats = SubarrayAccesses[subarray];
+    if (isWrite) {
+        stats.writes++;
+    } else {
+        stats.reads++;
+    }
+    if (!RowsTouched[subarray][row]) {
+        RowsTouched[subarray][row] = true;
+        stats.rowsAccessed++;
+    }
+    
+    uint32_t cluster = Mapper.getClusterIdForLocation(PhysicalMemoryLocation(bankId, subarrayId, row, 0));
+    if (cluster < ClusterAccesses.size()) {
+        ClusterAccesses[cluster]++;
+    }
+}
+
+bool MemoryMapExporter::writeJSON(const std::string &filename) const {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+    
+    file << "{\n";
+    file << "  \"architecture\": {\"banks\": " << Mapper.getNumBanks()
+         << ", \"subarraysPerBank\": " << Mapper.getNumSubarraysPerBank()
+         << ", \"rowsPerSubarray\": " << Mapper.getNumRowsPerSubarray()
+         << ", \"columnsPerRow\": " << Mapper.getNumColsPerRow()
+         << ", \"clustersPerSubarray\": " << Mapper.getNumClustersPerSubarray() << "},\n";
+    
+    // Matrix layouts
+    file << "  \"matrices\": [";
+    std::vector<std::string> names = Mapper.getMatrixNames();
+    for (size_t m = 0; m < names.size(); m++) {
+        MatrixMemoryLayout layout = Mapper.getMatrixLayout(names[m]);
+        file << (m == 0 ? "\n" : ",\n");
+        file << "    {\"name\": \"" << escapeJSON(names[m]) << "\", \"rows\": " << layout.rows
+             << ", \"cols\": " << layout.cols << ", \"rowMajor\": " << (layout.rowMajor ? "true" : "false")
+             << ", \"start\": ";
+        writeLocationJSON(file, layout.startLocation);
+        file << ", \"tileSize\": " << layout.tileSize << ", \"tiles\": [";
+        for (size_t t = 0; t < layout.tileLocations.size(); t++) {
+            file << (t == 0 ? "" : ", ");
+            writeLocationJSON(file, layout.tileLocations[t]);
+        }
+        file << "], \"hostResident\": " << (layout.hostResident ? "true" : "false")
+             << ", \"residentSlices\": " << layout.residentSlices << ", \"replicas\": [";
+        for (size_t r = 0; r < layout.replicaLocations.size(); r++) {
+            file << (r == 0 ? "" : ", ");
+            writeLocationJSON(file, layout.replicaLocations[r]);
+        }
+        file << "]}";
+    }
+    file << (names.empty() ? "],\n" : "\n  ],\n");
+    
+    // Value locations
+    file << "  \"values\": [";
+    auto values = Mapper.getValueLocations();
+    for (size_t v = 0; v < values.size(); v++) {
+        file << (v == 0 ? "\n" : ",\n");
+        file << "    {\"name\": \"" << escapeJSON(getValueName(values[v].first)) << "\", \"location\": ";
+        writeLocationJSON(file, values[v].second);
+        file << "}";
+    }
+    file << (values.empty() ? "],\n" : "\n  ],\n");
+    
+    // Subarray occupancy and accesses
+    file << "  \"subarrays\": [";
+    std::vector<SubarrayOccupancy> occupancy = Mapper.getSubarrayOccupancy();
+    for (size_t s = 0; s < occupancy.size(); s++) {
+        const SubarrayAccessStats &accesses = SubarrayAccesses[s];
+        file << (s == 0 ? "\n" : ",\n");
+        file << "    {\"bank\": " << occupancy[s].bankId << ", \"subarray\": " << occupancy[s].subarrayId
+             << ", \"usedBytes\": " << occupancy[s].usedBytes
+             << ", \"rowsAllocated\": " << occupancy[s].rowsAllocated
+             << ", \"rowsAccessed\": " << accesses.rowsAccessed
+             << ", \"reads\": " << accesses.reads << ", \"writes\": " << accesses.writes << "}";
+    }
+    file << (occupancy.empty() ? "],\n" : "\n  ],\n");
+    
+    // Cluster accesses
+    file << "  \"clusters\": [";
+    uint32_t clustersPerSubarray = Mapper.getNumClustersPerSubarray();
+    for (size_t c = 0; c < ClusterAccesses.size(); c++) {
+        uint32_t subarray = c / clustersPerSubarray;
+        file << (c == 0 ? "\n" : ",\n");
+        file << "    {\"bank\": " << subarray / Mapper.getNumSubarraysPerBank()
+             << ", \"subarray\": " << subarray % Mapper.getNumSubarraysPerBank()
+             << ", \"cluster\": " << c % clustersPerSubarray
+             << ", \"accesses\": " << ClusterAccesses[c] << "}";
+    }
+    file << (ClusterAccesses.empty() ? "]\n" : "\n  ]\n");
+    file << "}\n";
+    
+    return true;
+}
+
+bool MemoryMapExporter::writeCSV(const std::string &basePath) const {
+    std::ofstream layouts(basePath + "_layouts.csv");
+    std::ofstream subarrays(basePath + "_subarrays.csv");
+    std::ofstream clusters(basePath + "_clusters.csv");
+    if (!layouts.is_open() || !subarrays.is_open() || !clusters.is_open()) {
+        std::cerr << "Failed to open CSV files for: " << basePath << std::endl;
+        return false;
+    }
+    
+    writeLayoutRows(layouts);
+    
+    subarrays << "bank,subarray,used_bytes,rows_allocated,rows_accessed,reads,writes\n";
+    std::vector<SubarrayOccupancy> occupancy = Mapper.getSubarrayOccupancy();
+    for (size_t s = 0; s < occupancy.size(); s++) {
+        const SubarrayAccessStats &accesses = SubarrayAccesses[s];
+        subarrays << occupancy[s].bankId << "," << occupancy[s].subarrayId << ","
+                  << occupancy[s].usedBytes << "," << occupancy[s].rowsAllocated << ","
+                  << accesses.rowsAccessed << "," << accesses.reads << "," << accesses.writes << "\n";
+    }
+    
+    clusters << "bank,subarray,cluster,accesses\n";
+    uint32_t clustersPerSubarray = Mapper.getNumClustersPerSubarray();
+    for (size_t c = 0; c < ClusterAccesses.size(); c++) {
+        uint32_t subarray = c / clustersPerSubarray;
+        clusters << subarray / Mapper.getNumSubarraysPerBank() << ","
+                 << subarray % Mapper.getNumSubarraysPerBank() << ","
+                 << c % clustersPerSubarray << "," << ClusterAccesses[c] << "\n";
+    }
+    
+    return true;
+}
+
+void MemoryMapExporter::writeLayoutRows(std::ostream &out) const {
+    // One row per placed piece: matrix starts, tiles, replicas and values
+    out << "kind,name,index,bank,subarray,row,column,rows,cols,row_major,host_resident\n";
+    
+    for (const std::string &name : Mapper.getMatrixNames()) {
+        MatrixMemoryLayout layout = Mapper.getMatrixLayout(name);
+        std::string suffix = "," + std::to_string(layout.rows) + "," + std::to_string(layout.cols) + "," +
+                             (layout.rowMajor ? "1" : "0") + "," + (layout.hostResident ? "1" : "0") + "\n";
+        
+        out << "matrix," << escapeCSV(name) << ",0,";
+        writeLocationCSV(out, layout.startLocation);
+        out << suffix;
+        
+        for (size_t t = 0; t < layout.tileLocations.size(); t++) {
+            out << "tile," << escapeCSV(name) << "," << t << ",";
+            writeLocationCSV(out, layout.tileLocations[t]);
+            out << suffix;
+        }
+        
+        for (size_t r = 0; r < layout.replicaLocations.size(); r++) {
+            out << "replica," << escapeCSV(name) << "," << r << ",";
+            writeLocationCSV(out, layout.replicaLocations[r]);
+            out << suffix;
+        }
+    }
+    
+    for (const auto &value : Mapper.getValueLocations()) {
+        out << "value," << escapeCSV(getValueName(value.first)) << ",0,";
+        writeLocationCSV(out, value.second);
+        out << ",,,,\n";
+    }
+}
+
+bool MemoryMapExporter::writeHeatmap(const std::string &filename) const {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+    
+    std::vector<SubarrayOccupancy> occupancy = Mapper.getSubarrayOccupancy();
+    uint64_t subarrayBytes = static_cast<uint64_t>(Mapper.getNumRowsPerSubarray()) * Mapper.getNumColsPerRow();
+    
+    // Occupancy, accesses and allocated rows that are never accessed, per subarray
+    std::vector<double> used, accessed, wasted;
+    std::vector<std::string> usedLabels, accessedLabels, wastedLabels;
+    for (size_t s = 0; s < occupancy.size(); s++) {
+        const SubarrayAccessStats &accesses = SubarrayAccesses[s];
+        uint64_t total = accesses.reads + accesses.writes;
+        uint32_t idleRows = occupancy[s].rowsAllocated > accesses.rowsAccessed
+                                ? occupancy[s].rowsAllocated - accesses.rowsAccessed : 0;
+        
+        used.push_back(subarrayBytes > 0 ? static_cast<double>(occupancy[s].usedBytes) / subarrayBytes : 0.0);
+        accessed.push_back(static_cast<double>(total));
+        wasted.push_back(static_cast<double>(idleRows));
+        usedLabels.push_back(std::to_string(occupancy[s].usedBytes) + " bytes used");
+        accessedLabels.push_back(std::to_string(accesses.reads) + " reads, " +
+                                 std::to_string(accesses.writes) + " writes");
+        wastedLabels.push_back(std::to_string(idleRows) + " of " + std::to_string(occupancy[s].rowsAllocated) +
+                               " allocated rows never accessed");
+    }
+    
+    file << "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+         << "<title>pPIM memory map</title>\n"
+         << "<style>body { font-family: sans-serif; } svg { margin-bottom: 24px; }</style>\n"
+         << "</head>\n<body>\n<h1>pPIM memory map</h1>\n";
+    writeHeatmapGrid(file, "Subarray occupancy", used, usedLabels);
+    writeHeatmapGrid(file, "Subarray accesses", accessed, accessedLabels);
+    writeHeatmapGrid(file, "Allocated rows never accessed", wasted, wastedLabels);
+    file << "</body>\n</html>\n";
+    
+    return true;
+}
+
+void MemoryMapExporter::writeHeatmapGrid(std::ostream &out, const std::string &title,
+                                         const std::vector<double> &values,
+                                         const std::vector<std::string> &labels) const {
+    const uint32_t cellSize = 28;
+    const uint32_t margin = 60;
+    uint32_t numBanks = Mapper.getNumBanks();
+    uint32_t numSubarrays = Mapper.getNumSubarraysPerBank();
+    double maxValue = values.empty() ? 0.0 : *std::max_element(values.begin(), values.end());
+    
+    out << "<h2>" << title << "</h2>\n";
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << margin + numSubarrays * cellSize
+        << "\" height=\"" << margin + numBanks * cellSize << "\">\n";
+    
+    // Subarrays run along the x axis and banks along the y axis
+    for (uint32_t subarray = 0; subarray < numSubarrays; subarray++) {
+        out << "<text x=\"" << margin + subarray * cellSize + cellSize / 2 << "\" y=\"" << margin - 8
+            << "\" font-size=\"10\" text-anchor=\"middle\">" << subarray << "</text>\n";
+    }
+    for (uint32_t bank = 0; bank < numBanks; bank++) {
+        out << "<text x=\"" << margin - 8 << "\" y=\"" << margin + bank * cellSize + cellSize / 2 + 4
+            << "\" font-size=\"10\" text-anchor=\"end\">bank " << bank << "</text>\n";
+        
+        for (uint32_t subarray = 0; subarray < numSubarrays; subarray++) {
+            size_t index = bank * numSubarrays + subarray;
+            double value = index < values.size() ? values[index] : 0.0;
+            double intensity = maxValue > 0.0 ? value / maxValue : 0.0;
+            int shade = static_cast<int>(255.0 * (1.0 - intensity));
+            
+            out << "<rect x=\"" << margin + subarray * cellSize << "\" y=\"" << margin + bank * cellSize
+                << "\" width=\"" << cellSize - 1 << "\" height=\"" << cellSize - 1
+                << "\" fill=\"rgb(255," << shade << "," << shade << ")\" stroke=\"#ccc\">"
+                << "<title>Bank " << bank << ", subarray " << subarray;
+            if (index < labels.size()) {
+                out << ": " << labels[index];
+            }
+            out << "</title></rect>\n";
+        }
+    }
+    
+    out << "</svg>\n";
+}
+
+} // namespace ppim
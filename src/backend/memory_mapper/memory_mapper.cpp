@@ -1,51 +1,124 @@
 #include "backend/memory_mapper/memory_mapper.h"
+#include "llvm/IR/Instructions.h"
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <iterator>
+#include <cstdint>
 
 namespace ppim {
 
 MemoryMapper::MemoryMapper()
     : NumBanks(8), NumSubarraysPerBank(16), NumRowsPerSubarray(512), NumColsPerRow(2048),
-      NumClustersPerSubarray(4), NextAvailableBank(0), NextAvailableSubarray(0),
-      NextAvailableRow(0), NextAvailableCol(0) {
+      NumClustersPerSubarray(4), SubarrayBytes(0), Policy(PlacementPolicy::SEQUENTIAL),
+      TileSize(8), NextBank(0), NextStripe(0), ReplicationThreshold(0.0) {
     // Default initialization with typical pPIM architecture parameters
     // 8 banks, 16 subarrays per bank, 512 rows per subarray, 2048 columns per row
     // 4 clusters per subarray as described in the reference paper
+    resetAllocator();
 }
 
-void MemoryMapper::initialize(uint32_t numBanks, uint32_t numSubarraysPerBank, 
+bool MemoryMapper::initialize(uint32_t numBanks, uint32_t numSubarraysPerBank, 
                              uint32_t numRowsPerSubarray, uint32_t numColsPerRow) {
+    // Banks, subarrays or rows beyond the instruction fields would be masked
+    // into other ones when encoded
+    if (numBanks == 0 || numBanks > MaxBanks || numSubarraysPerBank == 0 ||
+        numSubarraysPerBank > MaxSubarraysPerBank || numRowsPerSubarray == 0 ||
+        numRowsPerSubarray > MaxRowsPerSubarray || numColsPerRow == 0) {
+        std::cerr << "Error: Unsupported memory geometry of " << numBanks << " banks, "
+                  << numSubarraysPerBank << " subarrays per bank, " << numRowsPerSubarray
+                  << " rows per subarray and " << numColsPerRow << " columns per row" << std::endl;
+        return false;
+    }
+    
     NumBanks = numBanks;
     NumSubarraysPerBank = numSubarraysPerBank;
     NumRowsPerSubarray = numRowsPerSubarray;
     NumColsPerRow = numColsPerRow;
     
     // Reset allocation tracking
-    NextAvailableBank = 0;
-    NextAvailableSubarray = 0;
-    NextAvailableRow = 0;
-    NextAvailableCol = 0;
+    resetAllocator();
     
-    // Clear maps
+    // Clear maps and the statistics of the previous mapping
     MatrixLayouts.clear();
     ValueLocations.clear();
+    LayoutStats = LayoutSelectionStats();
+    ReplStats = ReplicationStats();
+    return true;
 }
 
-MatrixMemoryLayout MemoryMapper::mapMatrix(const std::string &name, uint32_t rows, uint32_t cols) {
+MatrixMemoryLayout MemoryMapper::mapMatrix(const std::string &name, uint32_t rows, uint32_t cols,
+                                           bool rowMajor) {
     // Check if matrix is already mapped
     if (isMatrixMapped(name)) {
         return MatrixLayouts[name];
     }
     
-    // Calculate total size in bytes (assuming 1 byte per element for integer operands)
-    uint32_t totalSize = rows * cols;
+    // Create matrix memory layout
+    MatrixMemoryLayout layout(PhysicalMemoryLocation(), rows, cols, rowMajor);
     
-    // Allocate memory for the matrix
-    PhysicalMemoryLocation startLocation = allocateMemory(totalSize);
+    // Slices along the major dimension and bytes per slice
+    // (assuming 1 byte per element for integer operands)
+    uint32_t numSlices = rowMajor ? rows : cols;
+    uint32_t sliceSize = rowMajor ? cols : rows;
     
-    // Create matrix memory layout
-    MatrixMemoryLayout layout(startLocation, rows, cols, true); // Use row-major format by default
+    bool placed = false;
+    if ((Policy == PlacementPolicy::SUBARRAY_STRIPED || Policy == PlacementPolicy::COLOCATE_OPERANDS) &&
+        TileSize > 0 && numSlices > TileSize) {
+        // Striped placement: tile t goes to stripe (firstStripe + t) so that
+        // consecutive tiles land in different banks. Co-located placement
+        // starts every matrix at stripe 0, which puts tile t of all operands
+        // of a multiplication into the same subarray.
+        uint32_t firstStripe = (Policy == PlacementPolicy::COLOCATE_OPERANDS) ? 0 : NextStripe;
+        uint32_t numTiles = (numSlices + TileSize - 1) / TileSize;
+        
+        layout.tileSize = TileSize;
+        placed = true;
+        for (uint32_t t = 0; t < numTiles; t++) {
+            uint32_t tileSlices = std::min(TileSize, numSlices - t * TileSize);
+            PhysicalMemoryLocation tileLocation;
+            if (!allocateMemory(static_cast<uint64_t>(tileSlices) * sliceSize, tileLocation,
+                                getStripeSubarray(firstStripe + t))) {
+                placed = false;
+                break;
+            }
+            layout.tileLocations.push_back(tileLocation);
+        }
+        
+        if (placed) {
+            layout.startLocation = layout.tileLocations.front();
+            NextStripe = firstStripe + numTiles;
+        } else {
+            // Roll back the tiles placed so far
+            for (const auto &allocated : layout.tileLocations) {
+                freeMemory(allocated);
+            }
+            layout.tileLocations.clear();
+            layout.tileSize = 0;
+        }
+    } else {
+        // Contiguous placement, starting from the policy's preferred subarray
+        uint32_t startSubarray = 0;
+        if (Policy == PlacementPolicy::BANK_INTERLEAVED) {
+            startSubarray = NextBank * NumSubarraysPerBank;
+            NextBank = (NextBank + 1) % NumBanks;
+        } else if (Policy != PlacementPolicy::SEQUENTIAL) {
+            startSubarray = getStripeSubarray(NextStripe++);
+        }
+        
+        // Allocate memory for the matrix
+        placed = allocateMemory(static_cast<uint64_t>(rows) * cols, layout.startLocation, startSubarray);
+    }
+    
+    // The matrix does not fit in the remaining device memory: keep it in host
+    // memory and stage a window of it in and out of DRAM instead, leaving
+    // half of the free memory for other operands
+    uint64_t budget = getMemoryUsageStats().freeBytes / 2;
+    uint32_t maxSlices = sliceSize > 0 ? std::min<uint64_t>(numSlices, budget / sliceSize) : 0;
+    if (!placed && !allocateSpillWindow(layout, maxSlices, sliceSize)) {
+        std::cerr << "Error: Out of memory while mapping matrix " << name << std::endl;
+        return MatrixMemoryLayout();
+    }
     
     // Store the layout
     MatrixLayouts[name] = layout;
@@ -53,50 +126,224 @@ MatrixMemoryLayout MemoryMapper::mapMatrix(const std::string &name, uint32_t row
     return layout;
 }
 
-PhysicalMemoryLocation MemoryMapper::getElementLocation(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col) {
+MatrixMemoryLayout MemoryMapper::mapSpilledMatrix(const std::string &name, uint32_t rows, uint32_t cols,
+                                                  bool rowMajor, uint32_t maxResidentSlices) {
+    if (isMatrixMapped(name)) {
+        return MatrixLayouts[name];
+    }
+    
+    MatrixMemoryLayout layout(PhysicalMemoryLocation(), rows, cols, rowMajor);
+    uint32_t numSlices = rowMajor ? rows : cols;
+    uint32_t sliceSize = rowMajor ? cols : rows;
+    
+    if (!allocateSpillWindow(layout, std::min(maxResidentSlices, numSlices), sliceSize)) {
+        std::cerr << "Error: Out of memory while mapping matrix " << name << std::endl;
+        return MatrixMemoryLayout();
+    }
+    
+    MatrixLayouts[name] = layout;
+    return layout;
+}
+
+bool MemoryMapper::mapMatrixMultiplication(const std::string &matrixA, const std::string &matrixB,
+                                           const std::string &resultMatrix,
+                                           uint32_t rowsA, uint32_t colsA, uint32_t colsB) {
+    // Operands mapped before this call keep their layout and need no space
+    bool mappedA = isMatrixMapped(matrixA);
+    bool mappedB = isMatrixMapped(matrixB);
+    bool mappedC = isMatrixMapped(resultMatrix);
+    uint64_t sizeA = mappedA ? 0 : static_cast<uint64_t>(rowsA) * colsA;
+    uint64_t sizeB = mappedB ? 0 : static_cast<uint64_t>(colsA) * colsB;
+    uint64_t sizeC = mappedC ? 0 : static_cast<uint64_t>(rowsA) * colsB;
+    uint64_t freeBytes = getMemoryUsageStats().freeBytes;
+    
+    // Everything fits: map the operands as usual
+    if (sizeA + sizeB + sizeC <= freeBytes) {
+        if (mapMatrix(matrixA, rowsA, colsA).rows != 0 &&
+            mapMatrix(matrixB, colsA, colsB).rows != 0 &&
+            mapMatrix(resultMatrix, rowsA, colsB).rows != 0) {
+            return true;
+        }
+        
+        // Fragmentation got in the way, release only what this call mapped
+        // and fall back to spilling
+        if (!mappedA && isMatrixMapped(matrixA)) {
+            unmapMatrix(matrixA);
+        }
+        if (!mappedB && isMatrixMapped(matrixB)) {
+            unmapMatrix(matrixB);
+        }
+        if (!mappedC && isMatrixMapped(resultMatrix)) {
+            unmapMatrix(resultMatrix);
+        }
+    }
+    
+    // B is reused by every row block of A, so keep it resident when it takes
+    // at most half of the memory. A and C are streamed in blocks of rows and
+    // share what is left; a spilled B streams blocks of columns instead.
+    bool residentB = sizeB <= freeBytes / 2;
+    uint64_t streamBudget = residentB ? freeBytes - sizeB : freeBytes / 2;
+    uint32_t streamCols = (sizeA ? colsA : 0) + (sizeC ? colsB : 0);
+    uint32_t rowsPerBlock = streamCols > 0 ? streamBudget / streamCols : rowsA;
+    
+    if (residentB) {
+        if (mapMatrix(matrixB, colsA, colsB).rows == 0) {
+            return false;
+        }
+    } else {
+        uint32_t colsPerBlock = colsA > 0 ? (freeBytes / 2) / colsA : 0;
+        if (mapSpilledMatrix(matrixB, colsA, colsB, false, colsPerBlock).rows == 0) {
+            return false;
+        }
+    }
+    
+    if (rowsPerBlock >= rowsA) {
+        return mapMatrix(matrixA, rowsA, colsA).rows != 0 &&
+               mapMatrix(resultMatrix, rowsA, colsB).rows != 0;
+    }
+    
+    return mapSpilledMatrix(matrixA, rowsA, colsA, true, rowsPerBlock).rows != 0 &&
+           mapSpilledMatrix(resultMatrix, rowsA, colsB, true, rowsPerBlock).rows != 0;
+}
+
+bool MemoryMapper::unmapMatrix(const std::string &name) {
+    auto it = MatrixLayouts.find(name);
+    if (it == MatrixLayouts.end()) {
+        std::cerr << "Error: Matrix " << name << " is not mapped" << std::endl;
+        return false;
+    }
+    
+    // Return the matrix storage to the free lists
+    bool freed = true;
+    if (it->second.tileLocations.empty()) {
+        freed = freeMemory(it->second.startLocation);
+    } else {
+        for (const auto &tileLocation : it->second.tileLocations) {
+            freed = freeMemory(tileLocation) && freed;
+        }
+    }
+    for (const auto &replicaLocation : it->second.replicaLocations) {
+        PhysicalMemoryLocation region = replicaLocation;
+        region.columnOffset = 0;
+        freed = freeMemory(region) && freed;
+    }
+    MatrixLayouts.erase(it);
+    
+    return freed;
+}
+
+PhysicalMemoryLocation MemoryMapper::getElementLocation(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col) const {
     if (row >= matrix.rows || col >= matrix.cols) {
         std::cerr << "Error: Matrix index out of bounds" << std::endl;
         return PhysicalMemoryLocation();
     }
     
-    // Calculate offset based on storage format (row-major or column-major)
-    uint32_t offset;
-    if (matrix.rowMajor) {
-        offset = row * matrix.cols + col;
-    } else {
-        offset = col * matrix.rows + row;
+    return getPhysicalLocation(getElementAddress(matrix, row, col));
+}
+
+void MemoryMapper::getTileLocations(const MatrixMemoryLayout &matrix, IndexRange rowRange, IndexRange colRange,
+                                    std::vector<PhysicalMemoryLocation> &out) const {
+    if (rowRange.begin > rowRange.end || colRange.begin > colRange.end ||
+        rowRange.end > matrix.rows || colRange.end > matrix.cols) {
+        std::cerr << "Error: Matrix index out of bounds" << std::endl;
+        return;
     }
     
-    // Calculate physical location
-    PhysicalMemoryLocation location = matrix.startLocation;
+    out.reserve(out.size() + static_cast<size_t>(rowRange.end - rowRange.begin) * (colRange.end - colRange.begin));
     
-    // Add offset to column
-    location.columnOffset += offset;
+    // Distance in bytes between horizontally adjacent elements
+    uint32_t colStride = matrix.rowMajor ? 1 : matrix.rows;
     
-    // Handle column overflow
-    while (location.columnOffset >= NumColsPerRow) {
-        location.columnOffset -= NumColsPerRow;
-        location.rowAddress++;
+    // Elements of a block row are evenly spaced unless a column-major
+    // matrix changes tile or wraps its staging window within the row
+    bool evenlySpaced = matrix.rowMajor || (matrix.tileSize == 0 && !matrix.hostResident);
+    
+    for (uint32_t row = rowRange.begin; row < rowRange.end; row++) {
+        uint64_t address = getElementAddress(matrix, row, colRange.begin);
+        PhysicalMemoryLocation location = getPhysicalLocation(address);
         
-        // Handle row overflow
-        if (location.rowAddress >= NumRowsPerSubarray) {
-            location.rowAddress = 0;
-            location.subarrayId++;
+        for (uint32_t col = colRange.begin; col < colRange.end; col++) {
+            out.push_back(location);
             
-            // Handle subarray overflow
-            if (location.subarrayId >= NumSubarraysPerBank) {
-                location.subarrayId = 0;
-                location.bankId++;
-                
-                // Handle bank overflow (wrap around if needed)
-                if (location.bankId >= NumBanks) {
-                    location.bankId = 0;
+            // Step to the next element, decomposing the address again only
+            // when the step leaves the current DRAM row
+            if (evenlySpaced) {
+                address += colStride;
+                location.columnOffset += colStride;
+                if (location.columnOffset >= NumColsPerRow) {
+                    location = getPhysicalLocation(address);
                 }
+            } else if (col + 1 < colRange.end) {
+                location = getElementLocation(matrix, row, col + 1);
+            }
+        }
+    }
+}
+
+void MemoryMapper::getTileAccesses(const MatrixMemoryLayout &matrix, IndexRange rowRange, IndexRange colRange,
+                                   std::vector<StridedAccess> &out) const {
+    if (rowRange.begin > rowRange.end || colRange.begin > colRange.end ||
+        rowRange.end > matrix.rows || colRange.end > matrix.cols) {
+        std::cerr << "Error: Matrix index out of bounds" << std::endl;
+        return;
+    }
+    if (rowRange.begin == rowRange.end || colRange.begin == colRange.end) {
+        return;
+    }
+    
+    // Walk the block along the major dimension of the storage format
+    IndexRange majorRange = matrix.rowMajor ? rowRange : colRange;
+    IndexRange minorRange = matrix.rowMajor ? colRange : rowRange;
+    uint32_t sliceSize = matrix.rowMajor ? matrix.cols : matrix.rows;
+    auto getAddress = [&](uint32_t major, uint32_t minor) {
+        return matrix.rowMajor ? getElementAddress(matrix, major, minor) : getElementAddress(matrix, minor, major);
+    };
+    
+    // Slices are contiguous within a tile or a pass over the staging window
+    uint32_t period = matrix.hostResident ? matrix.residentSlices : matrix.tileSize;
+    bool fullSlices = minorRange.begin == 0 && minorRange.end == sliceSize;
+    
+    uint32_t major = majorRange.begin;
+    while (major < majorRange.end) {
+        uint32_t end = majorRange.end;
+        uint32_t wrap = 0;
+        if (matrix.hostResident && major % period == 0 && end - major > period) {
+            // From the first slot on, the rest of the block cycles through the window
+            wrap = period;
+        } else if (period > 0) {
+            end = std::min(end, (major / period + 1) * period);
+        }
+        
+        if (fullSlices) {
+            out.push_back(StridedAccess(getAddress(major, 0), 1, (end - major) * sliceSize, wrap * sliceSize));
+        } else {
+            // Slices past the first pass over the window revisit its slots
+            uint32_t last = wrap ? major + wrap : end;
+            for (uint32_t slice = major; slice < last; slice++) {
+                out.push_back(StridedAccess(getAddress(slice, minorRange.begin), 1,
+                                            minorRange.end - minorRange.begin));
             }
         }
+        major = end;
     }
+}
+
+void MemoryMapper::getAccessRows(const StridedAccess &access, std::vector<PhysicalMemoryLocation> &out) const {
+    // A wrapping access touches the rows of its first period only
+    uint32_t count = access.wrap ? std::min(access.count, access.wrap) : access.count;
     
-    return location;
+    uint32_t k = 0;
+    while (k < count) {
+        uint64_t address = access.base + static_cast<uint64_t>(k) * access.stride;
+        out.push_back(getPhysicalLocation(address));
+        if (access.stride == 0) {
+            break;
+        }
+        
+        // Skip to the first element past the end of this DRAM row
+        uint64_t rowEnd = (address / NumColsPerRow + 1) * NumColsPerRow;
+        k += static_cast<uint32_t>((rowEnd - address + access.stride - 1) / access.stride);
+    }
 }
 
 bool MemoryMapper::mapValues(llvm::Module *module) {
@@ -105,9 +352,14 @@ bool MemoryMapper::mapValues(llvm::Module *module) {
         return false;
     }
     
-    // Clear existing mappings
+    // Release and clear existing mappings
+    for (const auto &entry : ValueLocations) {
+        freeMemory(PhysicalMemoryLocation::unpack(entry.second));
+    }
     ValueLocations.clear();
     
+    const llvm::DataLayout &dataLayout = module->getDataLayout();
+    
     // Iterate through global variables
     for (auto &G : module->globals()) {
         // Skip external globals
@@ -115,26 +367,19 @@ bool MemoryMapper::mapValues(llvm::Module *module) {
             continue;
         }
         
-        // Allocate memory for the global variable
-        uint32_t size = 0;
-        llvm::Type *type = G.getValueType();
-        
-        // Calculate size based on type
-        if (type->isArrayTy()) {
-            size = type->getArrayNumElements();
-            llvm::Type *elemType = type->getArrayElementType();
-            if (elemType->isIntegerTy()) {
-                size *= (elemType->getIntegerBitWidth() + 7) / 8; // Round up to bytes
-            }
-        } else if (type->isIntegerTy()) {
-            size = (type->getIntegerBitWidth() + 7) / 8; // Round up to bytes
-        }
+        // Allocate memory for the global variable, sized as the data layout
+        // lays it out so that constant GEP offsets land inside it
+        uint64_t size = dataLayout.getTypeAllocSize(G.getValueType());
         
         // Allocate memory
-        PhysicalMemoryLocation location = allocateMemory(size);
+        PhysicalMemoryLocation location;
+        if (!allocateMemory(size, location)) {
+            std::cerr << "Error: Out of memory while mapping global " << G.getName().str() << std::endl;
+            return false;
+        }
         
         // Store the mapping
-        ValueLocations[&G] = location;
+        ValueLocations[&G] = location.pack();
     }
     
     // Iterate through functions
@@ -151,25 +396,18 @@ bool MemoryMapper::mapValues(llvm::Module *module) {
                 // Handle allocas
                 if (llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&I)) {
                     // Calculate size
-                    uint32_t size = 0;
-                    llvm::Type *type = alloca->getAllocatedType();
-                    
-                    // Calculate size based on type
-                    if (type->isArrayTy()) {
-                        size = type->getArrayNumElements();
-                        llvm::Type *elemType = type->getArrayElementType();
-                        if (elemType->isIntegerTy()) {
-                            size *= (elemType->getIntegerBitWidth() + 7) / 8; // Round up to bytes
-                        }
-                    } else if (type->isIntegerTy()) {
-                        size = (type->getIntegerBitWidth() + 7) / 8; // Round up to bytes
-                    }
+                    uint64_t size = dataLayout.getTypeAllocSize(alloca->getAllocatedType());
                     
                     // Allocate memory
-                    PhysicalMemoryLocation location = allocateMemory(size);
+                    PhysicalMemoryLocation location;
+                    if (!allocateMemory(size, location)) {
+                        std::cerr << "Error: Out of memory while mapping alloca "
+                                  << alloca->getName().str() << std::endl;
+                        return false;
+                    }
                     
                     // Store the mapping
-                    ValueLocations[alloca] = location;
+                    ValueLocations[alloca] = location.pack();
                 }
             }
         }
@@ -178,17 +416,21 @@ bool MemoryMapper::mapValues(llvm::Module *module) {
     return true;
 }
 
-PhysicalMemoryLocation MemoryMapper::getValueLocation(llvm::Value *value) {
+PhysicalMemoryLocation MemoryMapper::getValueLocation(llvm::Value *value) const {
     auto it = ValueLocations.find(value);
     if (it != ValueLocations.end()) {
-        return it->second;
+        return PhysicalMemoryLocation::unpack(it->second);
     }
     
     // Return default location if not found
     return PhysicalMemoryLocation();
 }
 
-MatrixMemoryLayout MemoryMapper::getMatrixLayout(const std::string &name) {
+PhysicalMemoryLocation MemoryMapper::offsetLocation(const PhysicalMemoryLocation &location, uint64_t bytes) const {
+    return getPhysicalLocation(getGlobalAddress(location) + bytes);
+}
+
+MatrixMemoryLayout MemoryMapper::getMatrixLayout(const std::string &name) const {
     auto it = MatrixLayouts.find(name);
     if (it != MatrixLayouts.end()) {
         return it->second;
@@ -198,7 +440,7 @@ MatrixMemoryLayout MemoryMapper::getMatrixLayout(const std::string &name) {
     return MatrixMemoryLayout();
 }
 
-bool MemoryMapper::isMatrixMapped(const std::string &name) {
+bool MemoryMapper::isMatrixMapped(const std::string &name) const {
     return MatrixLayouts.find(name) != MatrixLayouts.end();
 }
 
@@ -227,17 +469,148 @@ bool MemoryMapper::optimizeForMatrixMultiplication(const std::string &matrixA, c
         return false;
     }
     
-    // Optimize memory layout for matrix multiplication
-    // In a real implementation, this would involve:
-    // 1. Reorganizing matrices to minimize data movement
-    // 2. Placing matrices in subarrays that are close to the pPIM clusters
-    // 3. Aligning matrices to optimize access patterns
+    // Layout selection: every output reads a full column of B, so estimate
+    // the row activations of both storage formats for B at its current start
+    MatrixMemoryLayout rowMajorB(layoutB.startLocation, layoutB.rows, layoutB.cols, true);
+    MatrixMemoryLayout colMajorB(layoutB.startLocation, layoutB.rows, layoutB.cols, false);
+    uint64_t rowMajorCost = countColumnReadActivations(rowMajorB) * layoutA.rows;
+    uint64_t colMajorCost = countColumnReadActivations(colMajorB) * layoutA.rows;
+    
+    // Store B column-major when that saves activations. Co-located placement
+    // always does so that column tile t of B lands in the same subarray as
+    // row tile t of A, and a spilled B does so that its staging window holds
+    // whole columns.
+    bool transposeB = colMajorCost < rowMajorCost || Policy == PlacementPolicy::COLOCATE_OPERANDS ||
+                      layoutB.hostResident;
+    if (transposeB && layoutB.rowMajor) {
+        unmapMatrix(matrixB);
+        if (mapMatrix(matrixB, layoutB.rows, layoutB.cols, false).rows != 0) {
+            LayoutStats.operandsTransposed++;
+        } else {
+            // Put B back in its original format, which fits where it was
+            std::cerr << "Warning: Keeping matrix " << matrixB << " row-major" << std::endl;
+            if (mapMatrix(matrixB, layoutB.rows, layoutB.cols, true).rows == 0) {
+                return false;
+            }
+            transposeB = false;
+        }
+    }
+    
+    LayoutStats.rowActivationsRowMajor += rowMajorCost;
+    LayoutStats.rowActivationsSelected += transposeB ? colMajorCost : rowMajorCost;
+    
+    // B is read-only and read by every row of A: give distant subarrays
+    // holding rows of A their own copy
+    if (ReplicationThreshold > 0) {
+        replicateOperand(matrixB, matrixA);
+    }
     
-    // For now, we'll just return true as a placeholder
     return true;
 }
 
-uint32_t MemoryMapper::getClusterIdForLocation(const PhysicalMemoryLocation &location) {
+uint32_t MemoryMapper::replicateOperand(const std::string &name, const std::string &consumer) {
+    auto operand = MatrixLayouts.find(name);
+    auto consumerLayout = MatrixLayouts.find(consumer);
+    if (operand == MatrixLayouts.end() || consumerLayout == MatrixLayouts.end()) {
+        std::cerr << "Error: One or more matrices not mapped" << std::endl;
+        return 0;
+    }
+    
+    // The staging window of a spilled operand changes during execution, and
+    // the tiles of a tiled one sit at unrelated columns, so whole-row clones
+    // cannot reproduce either. A replica must fit in a single subarray.
+    MatrixMemoryLayout &layout = operand->second;
+    const MatrixMemoryLayout &rowsLayout = consumerLayout->second;
+    uint64_t size = static_cast<uint64_t>(layout.rows) * layout.cols;
+    if (layout.hostResident || layout.tileSize > 0 || size == 0) {
+        return 0;
+    }
+    
+    // The replica takes the whole rows spanned by the matrix
+    uint32_t firstColumn = layout.startLocation.columnOffset;
+    uint32_t replicaRows = (firstColumn + size + NumColsPerRow - 1) / NumColsPerRow;
+    uint64_t footprint = static_cast<uint64_t>(replicaRows) * NumColsPerRow;
+    if (replicaRows > NumRowsPerSubarray) {
+        return 0;
+    }
+    
+    // Bytes of the operand already stored in each subarray
+    std::map<uint32_t, uint64_t> localBytes;
+    uint32_t numSlices = layout.rowMajor ? layout.rows : layout.cols;
+    uint32_t sliceSize = layout.rowMajor ? layout.cols : layout.rows;
+    for (uint32_t slice = 0; slice < numSlices; slice++) {
+        uint64_t address = layout.rowMajor ? getElementAddress(layout, slice, 0)
+                                           : getElementAddress(layout, 0, slice);
+        localBytes[address / SubarrayBytes] += sliceSize;
+    }
+    
+    // Each consumer row reads the whole operand from the subarray holding it
+    std::map<uint32_t, uint64_t> remoteBytes;
+    for (uint32_t row = 0; row < rowsLayout.rows; row++) {
+        uint32_t subarray = getElementAddress(rowsLayout, row, 0) / SubarrayBytes;
+        remoteBytes[subarray] += size - localBytes[subarray];
+    }
+    
+    // Replicate into the subarrays that would avoid the most traffic first,
+    // as long as the traffic avoided outweighs the duplicated footprint
+    std::vector<std::pair<uint64_t, uint32_t>> candidates;
+    for (const auto &entry : remoteBytes) {
+        if (entry.second >= ReplicationThreshold * footprint) {
+            candidates.push_back(std::make_pair(entry.second, entry.first));
+        }
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+    
+    uint32_t created = 0;
+    for (const auto &candidate : candidates) {
+        PhysicalMemoryLocation location;
+        if (!allocateRowsInSubarray(replicaRows, candidate.second, location)) {
+            continue;
+        }
+        
+        location.columnOffset = firstColumn;
+        layout.replicaLocations.push_back(location);
+        ReplStats.replicasCreated++;
+        ReplStats.bytesReplicated += footprint;
+        ReplStats.remoteBytesAvoided += candidate.first;
+        created++;
+    }
+    
+    return created;
+}
+
+bool MemoryMapper::getLocalReplica(const MatrixMemoryLayout &matrix, const PhysicalMemoryLocation &consumer,
+                                   MatrixMemoryLayout &replica) const {
+    for (const auto &location : matrix.replicaLocations) {
+        if (location.bankId == consumer.bankId && location.subarrayId == consumer.subarrayId) {
+            replica = MatrixMemoryLayout(location, matrix.rows, matrix.cols, matrix.rowMajor);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+uint64_t MemoryMapper::countColumnReadActivations(const MatrixMemoryLayout &layout) const {
+    uint64_t activations = 0;
+    
+    // Walk each column top to bottom, counting every change of open row
+    for (uint32_t col = 0; col < layout.cols; col++) {
+        uint64_t openRow = UINT64_MAX;
+        for (uint32_t row = 0; row < layout.rows; row++) {
+            PhysicalMemoryLocation loc = getElementLocation(layout, row, col);
+            uint64_t rowId = getGlobalAddress(loc) / NumColsPerRow;
+            if (rowId != openRow) {
+                activations++;
+                openRow = rowId;
+            }
+        }
+    }
+    
+    return activations;
+}
+
+uint32_t MemoryMapper::getClusterIdForLocation(const PhysicalMemoryLocation &location) const {
     // Calculate cluster ID based on physical location
     // In the pPIM architecture, each subarray has 4 clusters
     // The cluster ID is determined by the subarray ID and the row address
@@ -256,45 +629,332 @@ uint32_t MemoryMapper::getClusterIdForLocation(const PhysicalMemoryLocation &loc
     return globalClusterId;
 }
 
-PhysicalMemoryLocation MemoryMapper::allocateMemory(uint32_t size) {
-    // Create a new physical memory location
-    PhysicalMemoryLocation location(NextAvailableBank, NextAvailableSubarray, NextAvailableRow, NextAvailableCol);
+std::vector<std::string> MemoryMapper::getMatrixNames() const {
+    std::vector<std::string> names;
+    for (const auto &entry : MatrixLayouts) {
+        names.push_back(entry.getKey().str());
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+std::vector<std::pair<const llvm::Value*, PhysicalMemoryLocation>> MemoryMapper::getValueLocations() const {
+    std::vector<std::pair<const llvm::Value*, PhysicalMemoryLocation>> locations;
+    for (const auto &entry : ValueLocations) {
+        locations.push_back(std::make_pair(entry.first, PhysicalMemoryLocation::unpack(entry.second)));
+    }
     
-    // Update next available location
-    NextAvailableCol += size;
+    // Order by address so that the result does not depend on pointer values
+    std::sort(locations.begin(), locations.end(),
+              [this](const std::pair<const llvm::Value*, PhysicalMemoryLocation> &a,
+                     const std::pair<const llvm::Value*, PhysicalMemoryLocation> &b) {
+                  return getGlobalAddress(a.second) < getGlobalAddress(b.second);
+              });
+    return locations;
+}
+
+std::vector<SubarrayOccupancy> MemoryMapper::getSubarrayOccupancy() const {
+    std::vector<SubarrayOccupancy> occupancy(FreeLists.size());
+    for (uint32_t s = 0; s < occupancy.size(); s++) {
+        occupancy[s].bankId = s / NumSubarraysPerBank;
+        occupancy[s].subarrayId = s % NumSubarraysPerBank;
+        occupancy[s].usedBytes = SubarrayBytes - FreeLists[s].freeBytes;
+    }
     
-    // Handle column overflow
-    while (NextAvailableCol >= NumColsPerRow) {
-        NextAvailableCol -= NumColsPerRow;
-        NextAvailableRow++;
-        
-        // Handle row overflow
-        if (NextAvailableRow >= NumRowsPerSubarray) {
-            NextAvailableRow = 0;
-            NextAvailableSubarray++;
-            
-            // Handle subarray overflow
-            if (NextAvailableSubarray >= NumSubarraysPerBank) {
-                NextAvailableSubarray = 0;
-                NextAvailableBank++;
-                
-                // Handle bank overflow (wrap around if needed)
-                if (NextAvailableBank >= NumBanks) {
-                    NextAvailableBank = 0;
-                }
+    // Allocations are disjoint and sorted by address, so rows before nextRow
+    // have already been counted
+    uint64_t nextRow = 0;
+    for (const auto &allocation : Allocations) {
+        uint64_t firstRow = allocation.first / NumColsPerRow;
+        uint64_t endRow = (allocation.first + allocation.second + NumColsPerRow - 1) / NumColsPerRow;
+        for (uint64_t row = std::max(firstRow, nextRow); row < endRow; row++) {
+            occupancy[row / NumRowsPerSubarray].rowsAllocated++;
+        }
+        nextRow = std::max(nextRow, endRow);
+    }
+    
+    return occupancy;
+}
+
+MemoryUsageStats MemoryMapper::getMemoryUsageStats() const {
+    MemoryUsageStats stats;
+    stats.totalBytes = SubarrayBytes * FreeLists.size();
+    stats.numAllocations = Allocations.size();
+    
+    // Gather free space from every subarray
+    uint64_t largestBlockBytes = 0;
+    for (const auto &freeList : FreeLists) {
+        stats.freeBytes += freeList.freeBytes;
+        stats.numFreeBlocks += freeList.byOffset.size();
+        if (!freeList.bySize.empty()) {
+            uint64_t largest = freeList.bySize.rbegin()->first;
+            stats.largestFreeBlock = std::max(stats.largestFreeBlock, largest);
+            largestBlockBytes += largest;
+        }
+    }
+    stats.usedBytes = stats.totalBytes - stats.freeBytes;
+    
+    // External fragmentation: share of free memory outside the largest block of its subarray
+    if (stats.freeBytes > 0) {
+        stats.fragmentation = 1.0 - static_cast<double>(largestBlockBytes) / stats.freeBytes;
+    }
+    
+    return stats;
+}
+
+void MemoryMapper::resetAllocator() {
+    SubarrayBytes = static_cast<uint64_t>(NumRowsPerSubarray) * NumColsPerRow;
+    uint32_t numSubarrays = NumBanks * NumSubarraysPerBank;
+    
+    // Every subarray starts out as a single free block
+    FreeLists.assign(numSubarrays, SubarrayFreeList());
+    if (SubarrayBytes > 0) {
+        for (uint32_t s = 0; s < numSubarrays; s++) {
+            insertFreeBlock(s, 0, SubarrayBytes);
+        }
+    }
+    
+    Allocations.clear();
+    NextBank = 0;
+    NextStripe = 0;
+}
+
+uint64_t MemoryMapper::getGlobalAddress(const PhysicalMemoryLocation &location) const {
+    uint64_t globalSubarrayId = static_cast<uint64_t>(location.bankId) * NumSubarraysPerBank + location.subarrayId;
+    return globalSubarrayId * SubarrayBytes +
+           static_cast<uint64_t>(location.rowAddress) * NumColsPerRow + location.columnOffset;
+}
+
+PhysicalMemoryLocation MemoryMapper::getPhysicalLocation(uint64_t globalAddress) const {
+    uint64_t globalSubarrayId = globalAddress / SubarrayBytes;
+    uint64_t offset = globalAddress % SubarrayBytes;
+    
+    return PhysicalMemoryLocation(globalSubarrayId / NumSubarraysPerBank,
+                                  globalSubarrayId % NumSubarraysPerBank,
+                                  offset / NumColsPerRow,
+                                  offset % NumColsPerRow);
+}
+
+uint64_t MemoryMapper::getElementAddress(const MatrixMemoryLayout &matrix, uint32_t row, uint32_t col) const {
+    // Index along the major dimension and within a slice of the storage format
+    uint64_t major = matrix.rowMajor ? row : col;
+    uint64_t minor = matrix.rowMajor ? col : row;
+    uint64_t sliceSize = matrix.rowMajor ? matrix.cols : matrix.rows;
+    
+    if (matrix.hostResident) {
+        // Spilled matrices address the slot of the slice in the staging window
+        major %= matrix.residentSlices;
+    } else if (matrix.tileSize > 0) {
+        // Tiles are contiguous, so the element is a fixed offset from its tile start
+        const PhysicalMemoryLocation &tile = matrix.tileLocations[major / matrix.tileSize];
+        return getGlobalAddress(tile) + (major % matrix.tileSize) * sliceSize + minor;
+    }
+    
+    return getGlobalAddress(matrix.startLocation) + major * sliceSize + minor;
+}
+
+bool MemoryMapper::allocateSpillWindow(MatrixMemoryLayout &layout, uint32_t maxSlices, uint32_t sliceSize) {
+    if (sliceSize == 0) {
+        return false;
+    }
+    
+    // Shrink the window until it can be allocated
+    for (uint32_t slices = maxSlices; slices > 0; slices /= 2) {
+        if (allocateMemory(static_cast<uint64_t>(slices) * sliceSize, layout.startLocation)) {
+            layout.hostResident = true;
+            layout.residentSlices = slices;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+uint32_t MemoryMapper::getStripeSubarray(uint32_t stripe) const {
+    // Walk the banks first so that consecutive stripes can be served by
+    // clusters in different banks, then move on to the next subarray
+    uint32_t bank = stripe % NumBanks;
+    uint32_t subarray = (stripe / NumBanks) % NumSubarraysPerBank;
+    return bank * NumSubarraysPerBank + subarray;
+}
+
+bool MemoryMapper::allocateMemory(uint64_t size, PhysicalMemoryLocation &location,
+                                  uint32_t startSubarray) {
+    // Every allocation occupies at least one byte so that it has a unique address
+    size = std::max<uint64_t>(size, 1);
+    uint32_t numSubarrays = FreeLists.size();
+    if (numSubarrays == 0) {
+        return false;
+    }
+    startSubarray %= numSubarrays;
+    
+    if (size <= SubarrayBytes) {
+        // Best fit within the first subarray (from the start hint) that can hold the request
+        for (uint32_t n = 0; n < numSubarrays; n++) {
+            if (allocateInSubarray(size, (startSubarray + n) % numSubarrays, location)) {
+                return true;
             }
         }
+        
+        return false;
+    }
+    
+    // Large allocations span a run of consecutive subarrays that are entirely
+    // free, preferring runs at or after the start hint
+    uint32_t subarraysNeeded = (size + SubarrayBytes - 1) / SubarrayBytes;
+    uint32_t runLength = 0;
+    for (uint32_t n = 0; n < 2 * numSubarrays - startSubarray; n++) {
+        uint32_t s = (startSubarray + n) % numSubarrays;
+        if (s == 0) {
+            runLength = 0;  // Runs cannot wrap around the end of the device
+        }
+        runLength = (FreeLists[s].freeBytes == SubarrayBytes) ? runLength + 1 : 0;
+        
+        if (runLength == subarraysNeeded) {
+            uint64_t globalAddress = (s + 1 - subarraysNeeded) * SubarrayBytes;
+            reserveRange(globalAddress, size);
+            Allocations[globalAddress] = size;
+            location = getPhysicalLocation(globalAddress);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool MemoryMapper::allocateInSubarray(uint64_t size, uint32_t subarray, PhysicalMemoryLocation &location) {
+    size = std::max<uint64_t>(size, 1);
+    if (subarray >= FreeLists.size()) {
+        return false;
+    }
+    
+    const auto &bySize = FreeLists[subarray].bySize;
+    auto block = bySize.lower_bound(std::make_pair(size, static_cast<uint64_t>(0)));
+    if (block == bySize.end()) {
+        return false;
     }
     
-    return location;
+    uint64_t globalAddress = subarray * SubarrayBytes + block->second;
+    reserveRange(globalAddress, size);
+    Allocations[globalAddress] = size;
+    location = getPhysicalLocation(globalAddress);
+    return true;
 }
 
-bool MemoryMapper::isMemoryAvailable(const PhysicalMemoryLocation &location, uint32_t size) {
-    // Check if the memory region is available
-    // In a real implementation, this would check for conflicts with existing allocations
+bool MemoryMapper::allocateRowsInSubarray(uint32_t numRows, uint32_t subarray, PhysicalMemoryLocation &location) {
+    if (subarray >= FreeLists.size() || numRows == 0) {
+        return false;
+    }
     
-    // For now, we'll just return true as a placeholder
+    // Smallest free block holding the rows once its start is rounded up to a row boundary
+    uint64_t size = static_cast<uint64_t>(numRows) * NumColsPerRow;
+    uint64_t bestOffset = 0;
+    uint64_t bestLength = UINT64_MAX;
+    for (const auto &block : FreeLists[subarray].byOffset) {
+        uint64_t aligned = (block.first + NumColsPerRow - 1) / NumColsPerRow * NumColsPerRow;
+        if (aligned + size <= block.first + block.second && block.second < bestLength) {
+            bestOffset = aligned;
+            bestLength = block.second;
+        }
+    }
+    if (bestLength == UINT64_MAX) {
+        return false;
+    }
+    
+    uint64_t globalAddress = subarray * SubarrayBytes + bestOffset;
+    reserveRange(globalAddress, size);
+    Allocations[globalAddress] = size;
+    location = getPhysicalLocation(globalAddress);
     return true;
 }
 
+bool MemoryMapper::freeMemory(const PhysicalMemoryLocation &location) {
+    auto it = Allocations.find(getGlobalAddress(location));
+    if (it == Allocations.end()) {
+        std::cerr << "Error: No allocation starts at the given location" << std::endl;
+        return false;
+    }
+    
+    releaseRange(it->first, it->second);
+    Allocations.erase(it);
+    
+    return true;
+}
+
+void MemoryMapper::reserveRange(uint64_t globalAddress, uint64_t size) {
+    // Walk the subarrays covered by the range
+    while (size > 0) {
+        uint32_t s = globalAddress / SubarrayBytes;
+        uint64_t offset = globalAddress % SubarrayBytes;
+        uint64_t length = std::min(size, SubarrayBytes - offset);
+        
+        // Find the free block containing the range (callers guarantee it exists)
+        auto &byOffset = FreeLists[s].byOffset;
+        auto it = std::prev(byOffset.upper_bound(offset));
+        uint64_t blockStart = it->first;
+        uint64_t blockEnd = it->first + it->second;
+        eraseFreeBlock(s, it);
+        
+        // Keep the parts of the block before and after the range
+        if (blockStart < offset) {
+            insertFreeBlock(s, blockStart, offset - blockStart);
+        }
+        if (offset + length < blockEnd) {
+            insertFreeBlock(s, offset + length, blockEnd - (offset + length));
+        }
+        
+        globalAddress += length;
+        size -= length;
+    }
+}
+
+void MemoryMapper::releaseRange(uint64_t globalAddress, uint64_t size) {
+    while (size > 0) {
+        uint32_t s = globalAddress / SubarrayBytes;
+        uint64_t offset = globalAddress % SubarrayBytes;
+        uint64_t length = std::min(size, SubarrayBytes - offset);
+        
+        auto &byOffset = FreeLists[s].byOffset;
+        uint64_t blockStart = offset;
+        uint64_t blockEnd = offset + length;
+        
+        // Coalesce with the following free block
+        auto next = byOffset.lower_bound(offset);
+        if (next != byOffset.end() && next->first == blockEnd) {
+            blockEnd += next->second;
+            auto following = std::next(next);
+            eraseFreeBlock(s, next);
+            next = following;
+        }
+        
+        // Coalesce with the preceding free block
+        if (next != byOffset.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == blockStart) {
+                blockStart = prev->first;
+                eraseFreeBlock(s, prev);
+            }
+        }
+        
+        insertFreeBlock(s, blockStart, blockEnd - blockStart);
+        
+        globalAddress += length;
+        size -= length;
+    }
+}
+
+void MemoryMapper::insertFreeBlock(uint32_t subarray, uint64_t offset, uint64_t length) {
+    SubarrayFreeList &freeList = FreeLists[subarray];
+    freeList.byOffset[offset] = length;
+    freeList.bySize.insert(std::make_pair(length, offset));
+    freeList.freeBytes += length;
+}
+
+void MemoryMapper::eraseFreeBlock(uint32_t subarray, std::map<uint64_t, uint64_t>::iterator block) {
+    SubarrayFreeList &freeList = FreeLists[subarray];
+    freeList.bySize.erase(std::make_pair(block->second, block->first));
+    freeList.freeBytes -= block->second;
+    freeList.byOffset.erase(block);
+}
+
 } // namespace ppim
@@ -0,0 +1,612 @@
+#include "backend/scheduler/instruction_scheduler.h"
+#include <algorithm>
+#include <set>
+#include <climits>
+
+namespace ppim {
+
+InstructionScheduler::InstructionScheduler(const TargetDescription &target) : Target(target) {}
+
+std::vector<PIMInstruction> InstructionScheduler::schedule(const std::vector<PIMInstruction> &instructions) {
+    Stats = SchedulerStats();
+    std::vector<PIMInstruction> scheduled;
+    scheduled.reserve(instructions.size());
+    
+    std::vector<Task> tasks = buildTasks(instructions);
+    addDependencies(tasks);
+    Stats.tasks = tasks.size();
+    Stats.criticalPath = getCriticalPath(tasks);
+    
+    // Tasks whose predecessors have all been emitted, in stream order
+    std::set<uint32_t> ready;
+    for (uint32_t t = 0; t < tasks.size(); t++) {
+        if (tasks[t].pendingPredecessors == 0) {
+            ready.insert(t);
+        }
+    }
+    
+    // Greedily emit the cheapest of the first few ready tasks; ties keep
+    // the original order
+    MachineState state;
+    std::vector<uint32_t> sources;
+    sources.reserve(instructions.size());
+    while (!ready.empty()) {
+        uint32_t best = *ready.begin();
+        double bestCost = getTaskCost(tasks[best], state);
+        uint32_t considered = 1;
+        for (auto it = std::next(ready.begin()); it != ready.end() && considered < Target.lookahead;
+             ++it, ++considered) {
+            double cost = getTaskCost(tasks[*it], state);
+            if (cost < bestCost) {
+                best = *it;
+                bestCost = cost;
+            }
+        }
+        
+        // Ready tasks do not depend on each other, so the other ready
+        // computations with the same opcode run right after the chosen one,
+        // on the same LUT configuration
+        std::vector<uint32_t> run(1, best);
+        if (tasks[best].computes) {
+            considered = 0;
+            for (auto it = ready.begin(); it != ready.end() && considered < Target.lookahead; ++it, ++considered) {
+                if (*it != best && tasks[*it].computes && tasks[*it].opcode == tasks[best].opcode) {
+                    run.push_back(*it);
+                }
+            }
+            if (run.size() > 1) {
+                Stats.sameOpcodeRuns++;
+                Stats.tasksInRuns += run.size();
+            }
+        }
+        
+        for (uint32_t t : run) {
+            ready.erase(t);
+            emitTask(tasks[t], state, scheduled, sources);
+        }
+        for (uint32_t t : run) {
+            for (uint32_t successor : tasks[t].successors) {
+                if (--tasks[successor].pendingPredecessors == 0) {
+                    ready.insert(successor);
+                }
+            }
+        }
+    }
+    Stats.hazardViolations = countHazardViolations(instructions, scheduled, sources);
+    
+    for (const auto &inst : instructions) {
+        if (inst.type == PIMInstructionType::PROG) {
+            Stats.progBefore++;
+        }
+    }
+    for (const auto &inst : scheduled) {
+        if (inst.type == PIMInstructionType::PROG) {
+            Stats.progAfter++;
+        }
+    }
+    Stats.rowActivationsBefore = countRowActivations(instructions);
+    Stats.rowActivationsAfter = countRowActivations(scheduled);
+    
+    return scheduled;
+}
+
+std::vector<InstructionScheduler::Task> InstructionScheduler::buildTasks(
+    const std::vector<PIMInstruction> &instructions) {
+    
+    std::vector<Task> tasks;
+    Task current;
+    bool ended = false;      // The current task has seen its END
+    bool empty = true;
+    bool writesRow = false;  // The current task writes its results to a row
+    uint32_t exeBank = 0;    // Bank of the current task's EXEs
+    
+    // Banks whose cores hold a result no row has stored
+    std::set<uint32_t> liveCoreResults;
+    
+    // Once a stationary operand has been loaded, every EXE may use it
+    bool stationaryLoaded = false;
+    
+    // Cores last programmed for each (bank, opcode), used by operations that
+    // rely on LUTs programmed by an earlier operation
+    std::map<std::pair<uint32_t, PIMOpcode>, std::vector<CoreKey>> knownCores;
+    std::set<std::pair<uint32_t, PIMOpcode>> programmedInTask;
+    
+    auto closeTask = [&]() {
+        // A computation may consume the result the previous one left in the
+        // cores of its bank, and one that stores no result leaves it there.
+        // The consumer of such a result writes it too, so no computation
+        // runs between the two and overwrites it.
+        if (current.computes) {
+            current.reads.push_back(getCoreResultKey(exeBank));
+            if (!writesRow || liveCoreResults.count(exeBank)) {
+                current.writes.push_back(getCoreResultKey(exeBank));
+            }
+            if (writesRow) {
+                liveCoreResults.erase(exeBank);
+            } else {
+                liveCoreResults.insert(exeBank);
+            }
+        }
+        if (!empty) {
+            tasks.push_back(current);
+        }
+        current = Task();
+        programmedInTask.clear();
+        ended = false;
+        empty = true;
+        writesRow = false;
+    };
+    
+    for (uint32_t i = 0; i < instructions.size(); i++) {
+        const PIMInstruction &inst = instructions[i];
+        switch (inst.type) {
+            case PIMInstructionType::PROG: {
+                // Programming starts the next operation, and a computation
+                // changing its function continues in a new task, so that
+                // every EXE of a task runs on the cores the task programs
+                if (ended || (current.computes && current.opcode != inst.opcode)) {
+                    closeTask();
+                }
+                
+                // The first PROG of a group replaces the known cores of its bank
+                auto key = std::make_pair(static_cast<uint32_t>(inst.bankId), inst.opcode);
+                auto &cores = knownCores[key];
+                if (programmedInTask.insert(key).second) {
+                    cores.clear();
+                }
+                if (current.opcode != inst.opcode) {
+                    current.cores.clear();
+                }
+                for (uint32_t coreId : getProgrammedCores(inst, Target.clustersPerRow, Target.coresPerCluster)) {
+                    cores.push_back(CoreKey(inst.bankId, coreId));
+                    current.cores.push_back(CoreKey(inst.bankId, coreId));
+                }
+                current.opcode = inst.opcode;
+                empty = false;
+                break;
+            }
+            case PIMInstructionType::EXE: {
+                if (ended || (current.computes && current.opcode != inst.opcode)) {
+                    closeTask();
+                }
+                
+                // Reduction steps after a route run on the configuration of
+                // the operation they complete
+                if (!current.computes) {
+                    if (current.cores.empty() || current.opcode != inst.opcode) {
+                        auto known = knownCores.find(std::make_pair(static_cast<uint32_t>(inst.bankId), inst.opcode));
+                        current.cores = known != knownCores.end() ? known->second : std::vector<CoreKey>();
+                    }
+                    current.opcode = inst.opcode;
+                }
+                current.computes = true;
+                exeBank = inst.bankId;
+                if (inst.bufferId) {
+                    current.reads.push_back(getBufferKey(inst.bankId, inst.bufferId));
+                }
+                if (stationaryLoaded && inst.bufferId != 3) {
+                    current.reads.push_back(getBufferKey(inst.bankId, 3));
+                }
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                empty = false;
+                break;
+            }
+            case PIMInstructionType::END:
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                ended = true;
+                empty = false;
+                break;
+            case PIMInstructionType::ROUTE:
+                // A route continues the operation whose partial results it moves
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                ended = false;
+                empty = false;
+                break;
+            case PIMInstructionType::MEMORY_READ:
+                // Operands of the next operation
+                if (ended) {
+                    closeTask();
+                }
+                current.reads.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                if (inst.bufferId) {
+                    current.writes.push_back(getBufferKey(inst.bankId, inst.bufferId));
+                }
+                stationaryLoaded = stationaryLoaded || inst.bufferId == 3;
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                empty = false;
+                break;
+            case PIMInstructionType::MEMORY_WRITE:
+                // Results of the current operation
+                current.writes.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                writesRow = true;
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                empty = false;
+                break;
+            case PIMInstructionType::HOST_LOAD:
+            case PIMInstructionType::HOST_STORE:
+            case PIMInstructionType::ROW_CLONE: {
+                // Transfers are scheduled on their own. A computation they
+                // interrupt continues in the next task, which consumes the
+                // results the first part left in the cores.
+                Task interrupted;
+                if (current.computes && !ended) {
+                    interrupted.computes = true;
+                    interrupted.opcode = current.opcode;
+                    interrupted.cores = current.cores;
+                }
+                closeTask();
+                RowKey row(inst.bankId, inst.subarrayId, inst.address);
+                if (inst.type == PIMInstructionType::HOST_STORE) {
+                    current.reads.push_back(row);
+                } else {
+                    current.writes.push_back(row);
+                }
+                if (inst.type == PIMInstructionType::ROW_CLONE) {
+                    current.reads.push_back(RowKey(inst.srcBankId, inst.srcSubarrayId, inst.srcAddress));
+                }
+                current.instructions.push_back(inst);
+                current.sources.push_back(i);
+                empty = false;
+                closeTask();
+                current = interrupted;
+                break;
+            }
+        }
+    }
+    closeTask();
+    
+    return tasks;
+}
+
+InstructionScheduler::RowKey InstructionScheduler::getBufferKey(uint32_t bankId, uint32_t bufferId) {
+    // Operand buffers are numbered past the last subarray of their bank
+    return RowKey(bankId, UINT_MAX - 1, bufferId);
+}
+
+InstructionScheduler::RowKey InstructionScheduler::getCoreResultKey(uint32_t bankId) {
+    // Numbered past the operand buffers of the bank
+    return RowKey(bankId, UINT_MAX - 2, 0);
+}
+
+void InstructionScheduler::addDependencies(std::vector<Task> &tasks) {
+    // Other operations that touch no rows are ordered against everything
+    // before and after them
+    const RowKey unknownRow(UINT_MAX, UINT_MAX, UINT_MAX);
+    
+    std::map<RowKey, uint32_t> lastWriter;
+    std::map<RowKey, std::vector<uint32_t>> readersSinceWrite;
+    
+    for (uint32_t t = 0; t < tasks.size(); t++) {
+        Task &task = tasks[t];
+        std::vector<RowKey> reads = task.reads;
+        std::vector<RowKey> writes = task.writes;
+        if (reads.empty() && writes.empty()) {
+            writes.push_back(unknownRow);
+        } else {
+            reads.push_back(unknownRow);
+        }
+        
+        std::set<uint32_t> predecessors;
+        
+        // Read after write
+        for (const RowKey &row : reads) {
+            auto writer = lastWriter.find(row);
+            if (writer != lastWriter.end()) {
+                predecessors.insert(writer->second);
+            }
+        }
+        
+        // Write after write and write after read
+        for (const RowKey &row : writes) {
+            auto writer = lastWriter.find(row);
+            if (writer != lastWriter.end()) {
+                predecessors.insert(writer->second);
+            }
+            for (uint32_t reader : readersSinceWrite[row]) {
+                predecessors.insert(reader);
+            }
+        }
+        
+        for (const RowKey &row : reads) {
+            readersSinceWrite[row].push_back(t);
+        }
+        for (const RowKey &row : writes) {
+            lastWriter[row] = t;
+            readersSinceWrite[row].clear();
+        }
+        
+        predecessors.erase(t);
+        for (uint32_t predecessor : predecessors) {
+            tasks[predecessor].successors.push_back(t);
+        }
+        task.pendingPredecessors = predecessors.size();
+    }
+}
+
+uint64_t InstructionScheduler::getCriticalPath(const std::vector<Task> &tasks) {
+    // Edges always point to later tasks
+    std::vector<uint64_t> depth(tasks.size(), 1);
+    uint64_t longest = 0;
+    for (uint32_t t = 0; t < tasks.size(); t++) {
+        for (uint32_t successor : tasks[t].successors) {
+            depth[successor] = std::max(depth[successor], depth[t] + 1);
+        }
+        longest = std::max(longest, depth[t]);
+    }
+    return longest;
+}
+
+InstructionScheduler::EffectTrace InstructionScheduler::traceEffects(const std::vector<PIMInstruction> &stream,
+                                                                    const std::vector<uint32_t> &ids) const {
+    EffectTrace trace;
+    std::map<RowKey, uint32_t> lastWriter;
+    std::map<CoreKey, PIMOpcode> lutState;
+    std::set<uint32_t> stationaryLoaded;   // Banks whose stationary buffer has been filled
+    std::set<uint32_t> liveResults;        // Banks whose cores hold a result no row has stored
+    std::set<uint32_t> computing;          // Banks between an EXE and its END
+    
+    for (size_t k = 0; k < stream.size(); k++) {
+        const PIMInstruction &inst = stream[k];
+        uint32_t id = ids[k];
+        if (inst.type == PIMInstructionType::PROG) {
+            for (uint32_t coreId : getProgrammedCores(inst, Target.clustersPerRow, Target.coresPerCluster)) {
+                lutState[CoreKey(inst.bankId, coreId)] = inst.opcode;
+            }
+            continue;
+        }
+        
+        std::vector<RowKey> reads;
+        std::vector<RowKey> writes;
+        bool writesCoreResult = false;
+        switch (inst.type) {
+            case PIMInstructionType::MEMORY_READ:
+                reads.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                if (inst.bufferId) {
+                    writes.push_back(getBufferKey(inst.bankId, inst.bufferId));
+                }
+                if (inst.bufferId == 3) {
+                    stationaryLoaded.insert(inst.bankId);
+                }
+                break;
+            case PIMInstructionType::MEMORY_WRITE:
+                reads.push_back(getCoreResultKey(inst.bankId));
+                writes.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                liveResults.erase(inst.bankId);
+                break;
+            case PIMInstructionType::HOST_LOAD:
+                writes.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                break;
+            case PIMInstructionType::HOST_STORE:
+                reads.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                reads.push_back(RowKey(inst.srcBankId, inst.srcSubarrayId, inst.srcAddress));
+                writes.push_back(RowKey(inst.bankId, inst.subarrayId, inst.address));
+                break;
+            case PIMInstructionType::EXE: {
+                if (inst.bufferId) {
+                    reads.push_back(getBufferKey(inst.bankId, inst.bufferId));
+                }
+                if (stationaryLoaded.count(inst.bankId) && inst.bufferId != 3) {
+                    reads.push_back(getBufferKey(inst.bankId, 3));
+                }
+                
+                // An EXE continues its computation's result, or consumes the
+                // unstored result of the previous computation
+                if (computing.count(inst.bankId) || liveResults.count(inst.bankId)) {
+                    reads.push_back(getCoreResultKey(inst.bankId));
+                }
+                writesCoreResult = true;
+                computing.insert(inst.bankId);
+                liveResults.insert(inst.bankId);
+                
+                // Cores of the bank that hold the EXE's function
+                std::vector<uint32_t> &cores = trace[id].lutCores;
+                for (const auto &lut : lutState) {
+                    if (lut.first.first == inst.bankId && lut.second == inst.opcode) {
+                        cores.push_back(lut.first.second);
+                    }
+                }
+                break;
+            }
+            case PIMInstructionType::ROUTE:
+                reads.push_back(getCoreResultKey(inst.bankId));
+                writesCoreResult = true;
+                break;
+            case PIMInstructionType::END:
+                computing.erase(inst.bankId);
+                break;
+            default:
+                break;
+        }
+        
+        // The writer each read sees and the writer each write replaces
+        InstructionEffects &effects = trace[id];
+        effects.occurrences++;
+        for (const RowKey &row : reads) {
+            auto writer = lastWriter.find(row);
+            effects.writers.push_back(writer != lastWriter.end() ? writer->second : UINT_MAX);
+        }
+        for (const RowKey &row : writes) {
+            auto writer = lastWriter.find(row);
+            effects.writers.push_back(writer != lastWriter.end() ? writer->second : UINT_MAX);
+            lastWriter[row] = id;
+        }
+        if (writesCoreResult) {
+            lastWriter[getCoreResultKey(inst.bankId)] = id;
+        }
+    }
+    
+    return trace;
+}
+
+uint64_t InstructionScheduler::countHazardViolations(const std::vector<PIMInstruction> &input,
+                                                     const std::vector<PIMInstruction> &output,
+                                                     const std::vector<uint32_t> &sources) const {
+    std::vector<uint32_t> ids(input.size());
+    for (uint32_t i = 0; i < input.size(); i++) {
+        ids[i] = input[i].type == PIMInstructionType::PROG ? UINT_MAX : i;
+    }
+    EffectTrace expected = traceEffects(input, ids);
+    EffectTrace actual = traceEffects(output, sources);
+    
+    // Every instruction must run once, see the same writers as in the input
+    // and find its function in every core of its bank that held it there
+    uint64_t violations = 0;
+    for (const auto &entry : expected) {
+        auto found = actual.find(entry.first);
+        if (found == actual.end() || found->second.occurrences != 1 ||
+            found->second.writers != entry.second.writers) {
+            violations++;
+            continue;
+        }
+        const std::vector<uint32_t> &held = found->second.lutCores;
+        for (uint32_t coreId : entry.second.lutCores) {
+            if (std::find(held.begin(), held.end(), coreId) == held.end()) {
+                violations++;
+                break;
+            }
+        }
+    }
+    for (const auto &entry : actual) {
+        if (!expected.count(entry.first)) {
+            violations++;
+        }
+    }
+    
+    return violations;
+}
+
+double InstructionScheduler::getTaskCost(const Task &task, const MachineState &state) const {
+    double cost = 0.0;
+    
+    // PROGs for the cores that would have to be reprogrammed
+    std::map<uint32_t, std::vector<uint32_t>> staleCores;
+    for (const CoreKey &core : task.cores) {
+        auto lut = state.lutState.find(core);
+        if (lut == state.lutState.end() || lut->second != task.opcode) {
+            staleCores[core.first].push_back(core.second);
+        }
+    }
+    for (const auto &bank : staleCores) {
+        cost += Target.progCost * buildProgInstructions(bank.first, task.opcode, bank.second, Target.clustersPerRow,
+                                                        Target.coresPerCluster).size();
+    }
+    
+    // Row-buffer hits and misses of the task's accesses in order
+    std::map<uint32_t, std::pair<uint32_t, uint32_t>> openRows;
+    auto access = [&](uint32_t bank, uint32_t subarray, uint32_t row) {
+        std::pair<uint32_t, uint32_t> target(subarray, row);
+        auto local = openRows.find(bank);
+        bool hit;
+        if (local != openRows.end()) {
+            hit = local->second == target;
+        } else {
+            auto open = state.openRows.find(bank);
+            hit = open != state.openRows.end() && open->second == target;
+        }
+        cost += hit ? Target.rowHitCost : Target.rowActivationCost;
+        openRows[bank] = target;
+    };
+    
+    for (const auto &inst : task.instructions) {
+        switch (inst.type) {
+            case PIMInstructionType::MEMORY_READ:
+            case PIMInstructionType::MEMORY_WRITE:
+            case PIMInstructionType::HOST_LOAD:
+            case PIMInstructionType::HOST_STORE:
+                access(inst.bankId, inst.subarrayId, inst.address);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                access(inst.srcBankId, inst.srcSubarrayId, inst.srcAddress);
+                access(inst.bankId, inst.subarrayId, inst.address);
+                break;
+            default:
+                break;
+        }
+    }
+    
+    return cost;
+}
+
+void InstructionScheduler::emitTask(const Task &task, MachineState &state, std::vector<PIMInstruction> &out,
+                                    std::vector<uint32_t> &sources) {
+    // Reprogram the cores that hold another function, broadcasting to the
+    // cores of a bank that share the control word
+    std::map<uint32_t, std::vector<uint32_t>> staleCores;
+    for (const CoreKey &core : task.cores) {
+        auto lut = state.lutState.find(core);
+        if (lut != state.lutState.end() && lut->second == task.opcode) {
+            continue;
+        }
+        staleCores[core.first].push_back(core.second);
+        state.lutState[core] = task.opcode;
+    }
+    for (const auto &bank : staleCores) {
+        auto progInstructions = buildProgInstructions(bank.first, task.opcode, bank.second, Target.clustersPerRow,
+                                                      Target.coresPerCluster);
+        out.insert(out.end(), progInstructions.begin(), progInstructions.end());
+        sources.insert(sources.end(), progInstructions.size(), UINT_MAX);
+    }
+    
+    for (size_t k = 0; k < task.instructions.size(); k++) {
+        const PIMInstruction &inst = task.instructions[k];
+        out.push_back(inst);
+        sources.push_back(task.sources[k]);
+        
+        switch (inst.type) {
+            case PIMInstructionType::MEMORY_READ:
+            case PIMInstructionType::MEMORY_WRITE:
+            case PIMInstructionType::HOST_LOAD:
+            case PIMInstructionType::HOST_STORE:
+                state.openRows[inst.bankId] = std::make_pair(inst.subarrayId, inst.address);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                state.openRows[inst.srcBankId] = std::make_pair(inst.srcSubarrayId, inst.srcAddress);
+                state.openRows[inst.bankId] = std::make_pair(inst.subarrayId, inst.address);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+uint64_t InstructionScheduler::countRowActivations(const std::vector<PIMInstruction> &instructions) {
+    uint64_t activations = 0;
+    std::map<uint32_t, std::pair<uint32_t, uint32_t>> openRows;
+    
+    auto access = [&](uint32_t bank, uint32_t subarray, uint32_t row) {
+        auto target = std::make_pair(subarray, row);
+        auto open = openRows.find(bank);
+        if (open == openRows.end() || open->second != target) {
+            activations++;
+            openRows[bank] = target;
+        }
+    };
+    
+    for (const auto &inst : instructions) {
+        switch (inst.type) {
+            case PIMInstructionType::MEMORY_READ:
+            case PIMInstructionType::MEMORY_WRITE:
+            case PIMInstructionType::HOST_LOAD:
+            case PIMInstructionType::HOST_STORE:
+                access(inst.bankId, inst.subarrayId, inst.address);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                access(inst.srcBankId, inst.srcSubarrayId, inst.srcAddress);
+                access(inst.bankId, inst.subarrayId, inst.address);
+                break;
+            default:
+                break;
+        }
+    }
+    
+    return activations;
+}
+
+} // namespace ppim
@@ -1,18 +1,33 @@
 #include "backend/simd/simd_generator.h"
+#include "backend/scheduler/instruction_scheduler.h"
 #include <iostream>
 #include <algorithm>
+#include <set>
+#include <tuple>
 
 namespace ppim {
 
 SIMDGenerator::SIMDGenerator() 
-    : ClustersPerRow(4), CoresPerCluster(9) {
+    : ClustersPerRow(4), CoresPerCluster(9), Pipelined(false),
+      RequestedDataflow(Dataflow::AUTO), ActiveDataflow(Dataflow::INPUT_STATIONARY),
+      RequestedKSplit(0), ActiveKSplit(1) {
     // Default initialization with typical pPIM architecture parameters
     // 4 clusters per row, 9 cores per cluster as described in the slides
 }
 
-void SIMDGenerator::initialize(uint32_t clustersPerRow, uint32_t coresPerCluster) {
+bool SIMDGenerator::initialize(uint32_t clustersPerRow, uint32_t coresPerCluster) {
+    // Clusters beyond the cluster masks or cores beyond the core IDs would
+    // be dropped when encoded
+    if (clustersPerRow == 0 || clustersPerRow > MaxClustersPerRow || coresPerCluster == 0 ||
+        clustersPerRow * coresPerCluster > MaxCoreIds) {
+        std::cerr << "Error: Unsupported geometry of " << clustersPerRow << " clusters per row and "
+                  << coresPerCluster << " cores per cluster" << std::endl;
+        return false;
+    }
+    
     ClustersPerRow = clustersPerRow;
     CoresPerCluster = coresPerCluster;
+    return true;
 }
 
 std::vector<PIMInstruction> SIMDGenerator::generateMatrixMultSIMD(
@@ -32,48 +47,252 @@ std::vector<PIMInstruction> SIMDGenerator::generateMatrixMultSIMD(
         return instructions;
     }
     
-    // Generate SIMD LUT programming instructions for MAC operation
-    auto progInstructions = generateSIMDLUTProgramming(PIMOpcode::MAC);
-    instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
+    // Lower with every dataflow and keep the requested one, or the one the
+    // cost model finds cheapest; ties go to the earlier dataflow
+    DataflowReport.clear();
+    ActiveKSplit = chooseKSplit(layoutA.cols, layoutB.cols);
+    size_t best = 0;
+    for (Dataflow dataflow : {Dataflow::OUTPUT_STATIONARY, Dataflow::WEIGHT_STATIONARY, Dataflow::INPUT_STATIONARY}) {
+        ActiveDataflow = dataflow;
+        auto candidate = generateMatrixMultForDataflow(layoutA, layoutB, layoutC, memMapper);
+        
+        DataflowEstimate estimate;
+        estimate.dataflow = dataflow;
+        estimate.instructions = candidate.size();
+        for (const auto &inst : candidate) {
+            estimate.reads += inst.type == PIMInstructionType::MEMORY_READ;
+        }
+        estimate.rowActivations = InstructionScheduler::countRowActivations(candidate);
+        estimate.cycles = estimateCycles(candidate, (layoutA.cols + ActiveKSplit - 1) / ActiveKSplit);
+        estimate.kSplit = ActiveKSplit;
+        DataflowReport.push_back(estimate);
+        
+        bool better = RequestedDataflow == Dataflow::AUTO
+                          ? instructions.empty() || estimate.cycles < DataflowReport[best].cycles
+                          : dataflow == RequestedDataflow;
+        if (better) {
+            best = DataflowReport.size() - 1;
+            instructions.swap(candidate);
+        }
+    }
+    DataflowReport[best].selected = true;
+    
+    return instructions;
+}
+
+std::vector<PIMInstruction> SIMDGenerator::generateMatrixMultForDataflow(
+    const MatrixMemoryLayout &layoutA, const MatrixMemoryLayout &layoutB,
+    const MatrixMemoryLayout &layoutC, const MemoryMapper &memMapper) {
+    
+    std::vector<PIMInstruction> instructions;
+    
+    // Fill the subarray-local replicas of B before any cluster reads them
+    instructions = generateReplicationInstructions(layoutB, memMapper);
+    
+    // Matrices that did not fit in device memory are processed block by
+    // block with explicit host staging phases
+    if (layoutA.hostResident || layoutB.hostResident || layoutC.hostResident) {
+        auto spilled = generateSpilledMatrixMultSIMD(layoutA, layoutB, layoutC, memMapper);
+        instructions.insert(instructions.end(), spilled.begin(), spilled.end());
+        return instructions;
+    }
+    
+    // Work for each bank is collected into its own stream of packets (one
+    // packet per block of outputs) so that clusters in different banks can
+    // process their outputs concurrently
+    std::map<uint32_t, std::vector<std::vector<PIMInstruction>>> bankStreams;
+    
+    // For each block of outputs, one column per cluster
+    std::map<uint32_t, uint32_t> residentKeys;
+    for (const auto &block : getOutputBlocks(IndexRange(0, layoutA.rows), IndexRange(0, layoutB.cols))) {
+        uint32_t bankId = 0;
+        std::vector<PIMInstruction> packet = generateOutputPacket(layoutA, layoutB, layoutC, block.first,
+                                                                  block.second, memMapper, bankId, residentKeys);
+        auto &stream = bankStreams[bankId];
+        
+        // Generate SIMD LUT programming instructions for MAC operation once per bank
+        if (stream.empty()) {
+            stream.push_back(generateSIMDLUTProgramming(PIMOpcode::MAC, bankId));
+        }
+        
+        stream.push_back(packet);
+    }
+    
+    // Each bank pipelines its own packets, after its LUT programming
+    if (Pipelined) {
+        for (auto &stream : bankStreams) {
+            std::vector<std::vector<PIMInstruction>> packets(stream.second.begin() + 1, stream.second.end());
+            auto pipelined = pipelinePackets(packets);
+            stream.second.resize(1);
+            stream.second.insert(stream.second.end(), pipelined.begin(), pipelined.end());
+        }
+    }
     
-    // For each row of matrix A
-    for (uint32_t i = 0; i < layoutA.rows; i++) {
-        // For each column of matrix B
-        for (uint32_t j = 0; j < layoutB.cols; j++) {
-            // Generate memory access instructions to load data from matrix A and B
-            std::vector<uint32_t> readAddresses;
+    auto interleaved = interleaveBankStreams(bankStreams);
+    instructions.insert(instructions.end(), interleaved.begin(), interleaved.end());
+    return instructions;
+}
+
+std::vector<PIMInstruction> SIMDGenerator::generateSpilledMatrixMultSIMD(
+    const MatrixMemoryLayout &layoutA, const MatrixMemoryLayout &layoutB,
+    const MatrixMemoryLayout &layoutC, const MemoryMapper &memMapper) {
+    
+    std::vector<PIMInstruction> instructions;
+    
+    // Staging windows hold whole rows of A and C and whole columns of B
+    if ((layoutA.hostResident && !layoutA.rowMajor) || (layoutB.hostResident && layoutB.rowMajor) ||
+        (layoutC.hostResident && !layoutC.rowMajor)) {
+        std::cerr << "Error: Unsupported storage format for spilled matrix operand" << std::endl;
+        return instructions;
+    }
+    
+    // Block sizes follow the staging windows of the spilled operands
+    uint32_t rowBlock = layoutA.rows;
+    if (layoutA.hostResident) {
+        rowBlock = std::min(rowBlock, layoutA.residentSlices);
+    }
+    if (layoutC.hostResident) {
+        rowBlock = std::min(rowBlock, layoutC.residentSlices);
+    }
+    uint32_t colBlock = layoutB.hostResident ? layoutB.residentSlices : layoutB.cols;
+    if (rowBlock == 0 || colBlock == 0) {
+        return instructions;
+    }
+    
+    // Blocks run one after another, so each bank is programmed once, before
+    // its first packet
+    std::set<uint32_t> programmedBanks;
+    std::map<uint32_t, uint32_t> residentKeys;
+    for (uint32_t ib = 0; ib < layoutA.rows; ib += rowBlock) {
+        uint32_t ibEnd = std::min(ib + rowBlock, layoutA.rows);
+        
+        // Stage rows ib..ibEnd of A into its window
+        if (layoutA.hostResident) {
+            auto stageIn = generateStagingInstructions(true, layoutA, IndexRange(ib, ibEnd),
+                                                       IndexRange(0, layoutA.cols), memMapper);
+            instructions.insert(instructions.end(), stageIn.begin(), stageIn.end());
+        }
+        
+        for (uint32_t jb = 0; jb < layoutB.cols; jb += colBlock) {
+            uint32_t jbEnd = std::min(jb + colBlock, layoutB.cols);
             
-            // Get addresses for row i of matrix A
-            for (uint32_t k = 0; k < layoutA.cols; k++) {
-                PhysicalMemoryLocation loc = memMapper.getElementLocation(layoutA, i, k);
-                readAddresses.push_back(loc.rowAddress);
+            // Stage columns jb..jbEnd of B into its window
+            if (layoutB.hostResident) {
+                auto stageIn = generateStagingInstructions(true, layoutB, IndexRange(0, layoutB.rows),
+                                                           IndexRange(jb, jbEnd), memMapper);
+                instructions.insert(instructions.end(), stageIn.begin(), stageIn.end());
             }
             
-            // Get addresses for column j of matrix B
-            for (uint32_t k = 0; k < layoutB.rows; k++) {
-                PhysicalMemoryLocation loc = memMapper.getElementLocation(layoutB, k, j);
-                readAddresses.push_back(loc.rowAddress);
+            // Compute the block of outputs from the resident operands. The
+            // pipeline drains before the next staging phase replaces them.
+            std::vector<std::vector<PIMInstruction>> packets;
+            for (const auto &block : getOutputBlocks(IndexRange(ib, ibEnd), IndexRange(jb, jbEnd))) {
+                uint32_t bankId = 0;
+                packets.push_back(generateOutputPacket(layoutA, layoutB, layoutC, block.first, block.second,
+                                                       memMapper, bankId, residentKeys));
+                if (programmedBanks.insert(bankId).second) {
+                    auto progInstructions = generateSIMDLUTProgramming(PIMOpcode::MAC, bankId);
+                    instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
+                }
             }
-            
-            // Generate SIMD memory read instructions
-            auto readInstructions = generateSIMDMemoryAccess(true, readAddresses);
-            instructions.insert(instructions.end(), readInstructions.begin(), readInstructions.end());
-            
-            // Generate SIMD compute instructions for MAC operation
-            auto computeInstructions = generateSIMDCompute(PIMOpcode::MAC);
-            instructions.insert(instructions.end(), computeInstructions.begin(), computeInstructions.end());
-            
-            // Generate memory write instruction for the result
-            PhysicalMemoryLocation resultLoc = memMapper.getElementLocation(layoutC, i, j);
-            std::vector<uint32_t> writeAddresses = {resultLoc.rowAddress};
-            auto writeInstructions = generateSIMDMemoryAccess(false, writeAddresses);
-            instructions.insert(instructions.end(), writeInstructions.begin(), writeInstructions.end());
+            if (Pipelined) {
+                packets = pipelinePackets(packets);
+            }
+            for (const auto &packet : packets) {
+                instructions.insert(instructions.end(), packet.begin(), packet.end());
+            }
+        }
+        
+        // Rows ib..ibEnd of C are complete, write them back to the host
+        if (layoutC.hostResident) {
+            auto stageOut = generateStagingInstructions(false, layoutC, IndexRange(ib, ibEnd),
+                                                        IndexRange(0, layoutC.cols), memMapper);
+            instructions.insert(instructions.end(), stageOut.begin(), stageOut.end());
         }
     }
     
     return instructions;
 }
 
+std::vector<PIMInstruction> SIMDGenerator::generateOutputPacket(
+    const MatrixMemoryLayout &layoutA, const MatrixMemoryLayout &layoutB,
+    const MatrixMemoryLayout &layoutC, uint32_t i, IndexRange cols,
+    const MemoryMapper &memMapper, uint32_t &bankId, std::map<uint32_t, uint32_t> &residentKeys) {
+    
+    std::vector<PIMInstruction> packet;
+    
+    // Get accesses for row i of matrix A
+    std::vector<StridedAccess> accessesA;
+    memMapper.getTileAccesses(layoutA, IndexRange(i, i + 1), IndexRange(0, layoutA.cols), accessesA);
+    
+    // Get accesses for the columns of matrix B, from the replica in the
+    // subarray holding row i of A if there is one
+    std::vector<StridedAccess> accessesB;
+    MatrixMemoryLayout replicaB;
+    PhysicalMemoryLocation firstA;
+    bool hasA = layoutA.cols > 0;
+    if (hasA) {
+        firstA = memMapper.getElementLocation(layoutA, i, 0);
+    }
+    bool localB = hasA && memMapper.getLocalReplica(layoutB, firstA, replicaB);
+    memMapper.getTileAccesses(localB ? replicaB : layoutB, IndexRange(0, layoutB.rows), cols, accessesB);
+    
+    // The outputs are computed by the clusters of the bank holding row i of A
+    bankId = hasA ? firstA.bankId : 0;
+    
+    // The stationary operand is only read when the bank's clusters do not
+    // already hold it, and then goes to the stationary buffer
+    std::vector<StridedAccess> stationaryAccesses;
+    if (ActiveDataflow != Dataflow::OUTPUT_STATIONARY) {
+        uint32_t key = ActiveDataflow == Dataflow::INPUT_STATIONARY ? i : cols.begin;
+        auto resident = residentKeys.find(bankId);
+        bool reuse = resident != residentKeys.end() && resident->second == key;
+        residentKeys[bankId] = key;
+        
+        auto &operand = ActiveDataflow == Dataflow::INPUT_STATIONARY ? accessesA : accessesB;
+        if (!reuse) {
+            stationaryAccesses.swap(operand);
+        }
+        operand.clear();
+    }
+    
+    // Generate SIMD memory read instructions
+    auto stationaryReads = generateSIMDMemoryAccess(true, stationaryAccesses, memMapper);
+    for (auto &inst : stationaryReads) {
+        inst.bufferId = 3;
+    }
+    packet.insert(packet.end(), stationaryReads.begin(), stationaryReads.end());
+    
+    std::vector<StridedAccess> readAccesses(accessesA);
+    readAccesses.insert(readAccesses.end(), accessesB.begin(), accessesB.end());
+    auto readInstructions = generateSIMDMemoryAccess(true, readAccesses, memMapper);
+    packet.insert(packet.end(), readInstructions.begin(), readInstructions.end());
+    
+    // Generate SIMD compute instructions for MAC operation. Clusters
+    // c * ActiveKSplit onwards accumulate output (i, cols.begin + c), each
+    // over its share of the inner dimension, so one EXE advances every
+    // output of the block; a partial block masks off the idle clusters.
+    uint32_t numOutputs = cols.end - cols.begin;
+    uint32_t clustersUsed = numOutputs * ActiveKSplit;
+    uint8_t clusterMask = clustersUsed < ClustersPerRow ? static_cast<uint8_t>((1u << clustersUsed) - 1) : 0;
+    auto computeInstructions = generateSIMDCompute(PIMOpcode::MAC, bankId, clusterMask);
+    packet.insert(packet.end(), computeInstructions.begin(), computeInstructions.end());
+    
+    // Combine the partial sums of split outputs
+    if (ActiveKSplit > 1) {
+        auto reduction = generateReductionTree(numOutputs, bankId);
+        packet.insert(packet.end(), reduction.begin(), reduction.end());
+    }
+    
+    // Generate memory write instructions for the results
+    std::vector<StridedAccess> writeAccesses;
+    memMapper.getTileAccesses(layoutC, IndexRange(i, i + 1), cols, writeAccesses);
+    auto writeInstructions = generateSIMDMemoryAccess(false, writeAccesses, memMapper);
+    packet.insert(packet.end(), writeInstructions.begin(), writeInstructions.end());
+    
+    return packet;
+}
+
 std::vector<PIMInstruction> SIMDGenerator::generateAtomicInstructions(
     PIMOpcode opcode, uint32_t numOperations) {
     
@@ -83,12 +302,11 @@ std::vector<PIMInstruction> SIMDGenerator::generateAtomicInstructions(
     auto progInstructions = generateSIMDLUTProgramming(opcode);
     instructions.insert(instructions.end(), progInstructions.begin(), progInstructions.end());
     
-    // Generate a single compute instruction that will be executed multiple times
+    // Generate a compute instruction repeated numOperations times
     PIMInstruction exeInst;
     exeInst.type = PIMInstructionType::EXE;
     exeInst.opcode = opcode;
-    // In a real implementation, we would set a repeat count or similar field
-    instructions.push_back(exeInst);
+    appendRepeatedExe(exeInst, numOperations, instructions);
     
     // Generate END instruction
     PIMInstruction endInst;
@@ -101,144 +319,388 @@ std::vector<PIMInstruction> SIMDGenerator::generateAtomicInstructions(
 std::vector<PIMInstruction> SIMDGenerator::mapToSIMD(
     const std::vector<PIMInstruction> &instructions) {
     
-    std::vector<PIMInstruction> simdInstructions;
+    // Group operations that share LUT configurations and rows, without
+    // moving any operation across the rows it depends on
+    TargetDescription target;
+    target.clustersPerRow = ClustersPerRow;
+    target.coresPerCluster = CoresPerCluster;
     
-    // Group instructions by type and opcode
-    std::vector<PIMInstruction> progInstructions;
-    std::vector<PIMInstruction> exeInstructions;
-    std::vector<PIMInstruction> memReadInstructions;
-    std::vector<PIMInstruction> memWriteInstructions;
+    InstructionScheduler scheduler(target);
+    std::vector<PIMInstruction> mapped = scheduler.schedule(instructions);
+    MapStats = scheduler.getStats();
+    
+    // The scheduler only moves tasks along its dependency edges; an
+    // instruction seeing other data or LUTs means those edges are incomplete
+    if (MapStats.hazardViolations) {
+        std::cerr << "Warning: " << MapStats.hazardViolations
+                  << " instructions changed their dependences when scheduled; keeping the original order" << std::endl;
+        return instructions;
+    }
+    return mapped;
+}
+
+void SIMDGenerator::printDataflowReport(std::ostream &out) const {
+    out << "Dataflow estimates:\n";
+    for (const auto &estimate : DataflowReport) {
+        out << "  " << getDataflowName(estimate.dataflow) << (estimate.selected ? " (selected)" : "")
+            << ": " << estimate.instructions << " instructions, " << estimate.reads << " reads, "
+            << estimate.rowActivations << " row activations, " << estimate.cycles << " cycles, K split "
+            << estimate.kSplit << "\n";
+    }
+}
+
+uint64_t SIMDGenerator::estimateCycles(const std::vector<PIMInstruction> &instructions, uint32_t exeCycles,
+                                       const TargetDescription &target) {
+    // Unbuffered reads and EXEs share operand buffer 1; reads into a buffer
+    // wait until the EXEs using its previous contents have finished
+    struct BankState {
+        double memoryFree = 0.0;
+        double computeFree = 0.0;
+        double lastExe = 0.0;
+        double bufferReady[4] = {0.0, 0.0, 0.0, 0.0};
+        double bufferFree[4] = {0.0, 0.0, 0.0, 0.0};
+        bool rowOpen = false;
+        std::pair<uint32_t, uint32_t> openRow;
+    };
+    std::map<uint32_t, BankState> banks;
+    double end = 0.0;
     
     for (const auto &inst : instructions) {
+        BankState &bank = banks[inst.bankId];
+        uint32_t buffer = inst.bufferId ? inst.bufferId : 1;
+        
+        // One row access on the memory port, starting no earlier than ready
+        auto access = [&](uint32_t subarray, uint32_t row, double ready) {
+            auto targetRow = std::make_pair(subarray, row);
+            bool hit = bank.rowOpen && bank.openRow == targetRow;
+            bank.memoryFree = std::max(bank.memoryFree, ready) + (hit ? target.rowHitCost : target.rowActivationCost);
+            bank.rowOpen = true;
+            bank.openRow = targetRow;
+        };
+        
         switch (inst.type) {
             case PIMInstructionType::PROG:
-                progInstructions.push_back(inst);
+                bank.computeFree += target.progCost;
                 break;
             case PIMInstructionType::EXE:
-                exeInstructions.push_back(inst);
+                bank.computeFree = std::max({bank.computeFree, bank.bufferReady[buffer], bank.bufferReady[3]}) +
+                                   (inst.opcode == PIMOpcode::MAC ? exeCycles : 1) * inst.repeatCount;
+                bank.bufferFree[buffer] = bank.computeFree;
+                bank.lastExe = bank.computeFree;
                 break;
             case PIMInstructionType::MEMORY_READ:
-                memReadInstructions.push_back(inst);
+                access(inst.subarrayId, inst.address, bank.bufferFree[buffer]);
+                bank.bufferReady[buffer] = bank.memoryFree;
                 break;
             case PIMInstructionType::MEMORY_WRITE:
-                memWriteInstructions.push_back(inst);
+            case PIMInstructionType::HOST_STORE:
+                access(inst.subarrayId, inst.address, bank.lastExe);
+                break;
+            case PIMInstructionType::HOST_LOAD:
+                access(inst.subarrayId, inst.address, 0.0);
+                break;
+            case PIMInstructionType::ROW_CLONE:
+                access(inst.srcSubarrayId, inst.srcAddress, 0.0);
+                access(inst.subarrayId, inst.address, 0.0);
+                break;
+            case PIMInstructionType::ROUTE:
+                bank.computeFree += target.rowHitCost;
                 break;
             default:
-                // Pass through other instructions unchanged
-                simdInstructions.push_back(inst);
                 break;
         }
+        end = std::max({end, bank.memoryFree, bank.computeFree});
     }
     
-    // Process PROG instructions
-    if (!progInstructions.empty()) {
-        // Group by opcode
-        std::map<PIMOpcode, std::vector<PIMInstruction>> opcodeGroups;
-        for (const auto &inst : progInstructions) {
-            opcodeGroups[inst.opcode].push_back(inst);
-        }
-        
-        // Generate SIMD LUT programming instructions for each opcode
-        for (const auto &group : opcodeGroups) {
-            auto simdProgs = generateSIMDLUTProgramming(group.first);
-            simdInstructions.insert(simdInstructions.end(), simdProgs.begin(), simdProgs.end());
+    return static_cast<uint64_t>(end + 0.5);
+}
+
+const char *SIMDGenerator::getDataflowName(Dataflow dataflow) {
+    switch (dataflow) {
+        case Dataflow::AUTO: return "auto";
+        case Dataflow::OUTPUT_STATIONARY: return "output-stationary";
+        case Dataflow::WEIGHT_STATIONARY: return "weight-stationary";
+        case Dataflow::INPUT_STATIONARY: return "input-stationary";
+    }
+    return "unknown";
+}
+
+bool SIMDGenerator::parseDataflow(const std::string &name, Dataflow &dataflow) {
+    for (Dataflow candidate : {Dataflow::AUTO, Dataflow::OUTPUT_STATIONARY, Dataflow::WEIGHT_STATIONARY,
+                               Dataflow::INPUT_STATIONARY}) {
+        if (name == getDataflowName(candidate)) {
+            dataflow = candidate;
+            return true;
         }
     }
+    return false;
+}
+
+std::vector<std::pair<uint32_t, IndexRange>> SIMDGenerator::getOutputBlocks(IndexRange rows,
+                                                                            IndexRange cols) const {
+    std::vector<std::pair<uint32_t, IndexRange>> blocks;
+    
+    uint32_t outputsPerBlock = std::max(1u, ClustersPerRow / ActiveKSplit);
+    
+    auto addBlock = [&](uint32_t i, uint32_t j) {
+        blocks.push_back(std::make_pair(i, IndexRange(j, std::min(j + outputsPerBlock, cols.end))));
+    };
     
-    // Process EXE instructions
-    if (!exeInstructions.empty()) {
-        // Group by opcode
-        std::map<PIMOpcode, std::vector<PIMInstruction>> opcodeGroups;
-        for (const auto &inst : exeInstructions) {
-            opcodeGroups[inst.opcode].push_back(inst);
+    // B columns stay resident while i varies, so the column loop is outermost
+    if (ActiveDataflow == Dataflow::WEIGHT_STATIONARY) {
+        for (uint32_t j = cols.begin; j < cols.end; j += outputsPerBlock) {
+            for (uint32_t i = rows.begin; i < rows.end; i++) {
+                addBlock(i, j);
+            }
         }
-        
-        // Generate SIMD compute instructions for each opcode
-        for (const auto &group : opcodeGroups) {
-            auto simdExes = generateSIMDCompute(group.first);
-            simdInstructions.insert(simdInstructions.end(), simdExes.begin(), simdExes.end());
+    } else {
+        for (uint32_t i = rows.begin; i < rows.end; i++) {
+            for (uint32_t j = cols.begin; j < cols.end; j += outputsPerBlock) {
+                addBlock(i, j);
+            }
         }
     }
     
-    // Process memory read instructions
-    if (!memReadInstructions.empty()) {
-        std::vector<uint32_t> readAddresses;
-        for (const auto &inst : memReadInstructions) {
-            readAddresses.push_back(inst.address);
-        }
-        
-        auto simdReads = generateSIMDMemoryAccess(true, readAddresses);
-        simdInstructions.insert(simdInstructions.end(), simdReads.begin(), simdReads.end());
+    return blocks;
+}
+
+std::vector<std::vector<PIMInstruction>> SIMDGenerator::pipelinePackets(
+    const std::vector<std::vector<PIMInstruction>> &packets) {
+    
+    std::vector<std::vector<PIMInstruction>> pipelined;
+    if (packets.empty()) {
+        return pipelined;
     }
+    pipelined.resize(packets.size() + 1);
+    
+    // Append the streamed reads, or everything else, of packet t to a stage,
+    // tagging them and the EXEs with the packet's operand buffer. Reloads of
+    // the stationary operand are not hoisted, as the previous packet still
+    // computes with the old contents.
+    auto appendPart = [&](size_t t, bool reads, std::vector<PIMInstruction> &stage) {
+        uint8_t bufferId = static_cast<uint8_t>(t % 2 + 1);
+        for (const auto &packetInst : packets[t]) {
+            bool streamed = packetInst.type == PIMInstructionType::MEMORY_READ && packetInst.bufferId == 0;
+            if (streamed != reads) {
+                continue;
+            }
+            PIMInstruction inst = packetInst;
+            if (streamed || inst.type == PIMInstructionType::EXE) {
+                inst.bufferId = bufferId;
+            }
+            stage.push_back(inst);
+        }
+    };
     
-    // Process memory write instructions
-    if (!memWriteInstructions.empty()) {
-        std::vector<uint32_t> writeAddresses;
-        for (const auto &inst : memWriteInstructions) {
-            writeAddresses.push_back(inst.address);
+    // Stage t issues the reads of packet t, which fill its buffer, and then
+    // the compute and writes of packet t - 1 from the other buffer
+    for (size_t t = 0; t <= packets.size(); t++) {
+        if (t < packets.size()) {
+            appendPart(t, true, pipelined[t]);
+        }
+        if (t > 0) {
+            appendPart(t - 1, false, pipelined[t]);
         }
-        
-        auto simdWrites = generateSIMDMemoryAccess(false, writeAddresses);
-        simdInstructions.insert(simdInstructions.end(), simdWrites.begin(), simdWrites.end());
     }
     
-    return simdInstructions;
+    return pipelined;
 }
 
-std::vector<PIMInstruction> SIMDGenerator::generateSIMDLUTProgramming(PIMOpcode opcode) {
-    std::vector<PIMInstruction> instructions;
-    
-    // Generate PROG instructions for each core in each cluster in the row
-    for (uint32_t clusterId = 0; clusterId < ClustersPerRow; clusterId++) {
-        for (uint32_t coreId = 0; coreId < CoresPerCluster; coreId++) {
-            PIMInstruction progInst;
-            progInst.type = PIMInstructionType::PROG;
-            progInst.coreId = clusterId * CoresPerCluster + coreId;
-            progInst.opcode = opcode;
-            instructions.push_back(progInst);
-        }
+std::vector<PIMInstruction> SIMDGenerator::generateSIMDLUTProgramming(PIMOpcode opcode, uint32_t bankId) {
+    // Every core in each cluster in the row gets the same control word, so
+    // this is a single broadcast PROG
+    std::vector<uint32_t> coreIds(ClustersPerRow * CoresPerCluster);
+    for (uint32_t coreId = 0; coreId < coreIds.size(); coreId++) {
+        coreIds[coreId] = coreId;
     }
     
-    return instructions;
+    return buildProgInstructions(bankId, opcode, coreIds, ClustersPerRow, CoresPerCluster);
 }
 
-std::vector<PIMInstruction> SIMDGenerator::generateSIMDCompute(PIMOpcode opcode) {
+std::vector<PIMInstruction> SIMDGenerator::generateSIMDCompute(PIMOpcode opcode, uint32_t bankId,
+                                                             uint8_t clusterMask) {
     std::vector<PIMInstruction> instructions;
     
     // Generate EXE instruction
     PIMInstruction exeInst;
     exeInst.type = PIMInstructionType::EXE;
     exeInst.opcode = opcode;
+    exeInst.bankId = bankId;
+    exeInst.clusterMask = clusterMask;
     instructions.push_back(exeInst);
     
     // Generate END instruction
     PIMInstruction endInst;
     endInst.type = PIMInstructionType::END;
+    endInst.bankId = bankId;
     instructions.push_back(endInst);
     
     return instructions;
 }
 
+uint32_t SIMDGenerator::chooseKSplit(uint32_t k, uint32_t n) const {
+    uint32_t limit = std::min(ClustersPerRow, std::max(k, 1u));
+    uint32_t split = 1;
+    
+    if (RequestedKSplit > 0) {
+        // Largest power of two not above the requested factor
+        while (split * 2 <= RequestedKSplit && split * 2 <= limit) {
+            split *= 2;
+        }
+        return split;
+    }
+    
+    // Only split into clusters a block of outputs would leave idle
+    uint32_t outputs = std::max(1u, std::min(n, ClustersPerRow));
+    while (outputs * split * 2 <= ClustersPerRow && split * 2 <= limit) {
+        split *= 2;
+    }
+    return split;
+}
+
+std::vector<PIMInstruction> SIMDGenerator::generateReductionTree(uint32_t numOutputs, uint32_t bankId) {
+    std::vector<PIMInstruction> instructions;
+    
+    // At distance d, the cluster at offset c of each output with c a multiple
+    // of 2d receives the partial sum of the cluster at c + d and adds it to
+    // its own. The MAC configuration includes the adder cores, so no PROG is
+    // needed between the levels.
+    for (uint32_t distance = 1; distance < ActiveKSplit; distance *= 2) {
+        uint8_t receivers = 0;
+        for (uint32_t output = 0; output < numOutputs; output++) {
+            for (uint32_t offset = 0; offset < ActiveKSplit; offset += 2 * distance) {
+                receivers |= static_cast<uint8_t>(1u << (output * ActiveKSplit + offset));
+            }
+        }
+        
+        PIMInstruction routeInst;
+        routeInst.type = PIMInstructionType::ROUTE;
+        routeInst.bankId = bankId;
+        routeInst.clusterMask = receivers;
+        routeInst.address = distance;
+        instructions.push_back(routeInst);
+        
+        auto addInstructions = generateSIMDCompute(PIMOpcode::ADD, bankId, receivers);
+        instructions.insert(instructions.end(), addInstructions.begin(), addInstructions.end());
+    }
+    
+    return instructions;
+}
+
 std::vector<PIMInstruction> SIMDGenerator::generateSIMDMemoryAccess(
-    bool isRead, const std::vector<uint32_t> &addresses) {
+    bool isRead, const std::vector<StridedAccess> &accesses, const MemoryMapper &memMapper) {
     
     std::vector<PIMInstruction> instructions;
     
-    // Group addresses by row to minimize row activations
-    std::map<uint32_t, std::vector<uint32_t>> rowGroups;
-    for (uint32_t addr : addresses) {
-        rowGroups[addr].push_back(addr);
+    // Collect the rows each access touches, without visiting its elements
+    std::vector<PhysicalMemoryLocation> rowLocations;
+    for (const auto &access : accesses) {
+        memMapper.getAccessRows(access, rowLocations);
     }
     
+    // Access each (bank, subarray, row) once, in order, to minimize row activations
+    std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> rows;
+    rows.reserve(rowLocations.size());
+    for (const auto &loc : rowLocations) {
+        rows.push_back(std::make_tuple(loc.bankId, loc.subarrayId, loc.rowAddress));
+    }
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    
     // Generate memory access instructions for each row
-    for (const auto &group : rowGroups) {
+    for (const auto &row : rows) {
         PIMInstruction memInst;
         memInst.type = isRead ? PIMInstructionType::MEMORY_READ : PIMInstructionType::MEMORY_WRITE;
-        memInst.address = group.first;
+        memInst.bankId = std::get<0>(row);
+        memInst.subarrayId = std::get<1>(row);
+        memInst.address = std::get<2>(row);
         instructions.push_back(memInst);
     }
     
     return instructions;
 }
 
+std::vector<PIMInstruction> SIMDGenerator::generateStagingInstructions(
+    bool toDevice, const MatrixMemoryLayout &layout, IndexRange rowRange, IndexRange colRange,
+    const MemoryMapper &memMapper) {
+    
+    // Transfer every DRAM row covered by the block once
+    std::vector<StridedAccess> accesses;
+    memMapper.getTileAccesses(layout, rowRange, colRange, accesses);
+    std::vector<PIMInstruction> instructions = generateSIMDMemoryAccess(!toDevice, accesses, memMapper);
+    
+    for (auto &inst : instructions) {
+        inst.type = toDevice ? PIMInstructionType::HOST_LOAD : PIMInstructionType::HOST_STORE;
+    }
+    
+    return instructions;
+}
+
+std::vector<PIMInstruction> SIMDGenerator::generateReplicationInstructions(
+    const MatrixMemoryLayout &layout, const MemoryMapper &memMapper) {
+    
+    std::vector<PIMInstruction> instructions;
+    if (layout.replicaLocations.empty()) {
+        return instructions;
+    }
+    
+    std::vector<PhysicalMemoryLocation> sourceLocations;
+    memMapper.getTileLocations(layout, IndexRange(0, layout.rows), IndexRange(0, layout.cols), sourceLocations);
+    
+    for (const auto &replicaLocation : layout.replicaLocations) {
+        MatrixMemoryLayout replica(replicaLocation, layout.rows, layout.cols, layout.rowMajor);
+        std::vector<PhysicalMemoryLocation> replicaLocations;
+        memMapper.getTileLocations(replica, IndexRange(0, layout.rows), IndexRange(0, layout.cols),
+                                   replicaLocations);
+        
+        // The replica starts at the same column as the matrix, so each source
+        // row maps onto one destination row; clone each pair once
+        std::set<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t>> cloned;
+        for (size_t e = 0; e < sourceLocations.size() && e < replicaLocations.size(); e++) {
+            const PhysicalMemoryLocation &src = sourceLocations[e];
+            const PhysicalMemoryLocation &dst = replicaLocations[e];
+            if (!cloned.insert(std::make_tuple(src.bankId, src.subarrayId, src.rowAddress,
+                                               dst.bankId, dst.subarrayId, dst.rowAddress)).second) {
+                continue;
+            }
+            
+            PIMInstruction cloneInst;
+            cloneInst.type = PIMInstructionType::ROW_CLONE;
+            cloneInst.srcBankId = src.bankId;
+            cloneInst.srcSubarrayId = src.subarrayId;
+            cloneInst.srcAddress = src.rowAddress;
+            cloneInst.bankId = dst.bankId;
+            cloneInst.subarrayId = dst.subarrayId;
+            cloneInst.address = dst.rowAddress;
+            instructions.push_back(cloneInst);
+        }
+    }
+    
+    return instructions;
+}
+
+std::vector<PIMInstruction> SIMDGenerator::interleaveBankStreams(
+    const std::map<uint32_t, std::vector<std::vector<PIMInstruction>>> &bankStreams) {
+    
+    std::vector<PIMInstruction> instructions;
+    
+    // Take one packet from each bank in turn until all streams are drained
+    for (size_t packet = 0; ; packet++) {
+        bool emitted = false;
+        for (const auto &stream : bankStreams) {
+            if (packet < stream.second.size()) {
+                const auto &packetInstructions = stream.second[packet];
+                instructions.insert(instructions.end(), packetInstructions.begin(), packetInstructions.end());
+                emitted = true;
+            }
+        }
+        
+        if (!emitted) {
+            break;
+        }
+    }
+    
+    return instructions;
+}
+
 } // namespace ppim
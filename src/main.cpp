@@ -12,6 +12,8 @@
 #include "frontend/ir_generator/ir_generator.h"
 #include "middle_end/optimization/optimizer.h"
 #include "backend/code_generator/code_generator.h"
+#include "backend/simd/simd_generator.h"
+#include "backend/memory_mapper/memory_map_exporter.h"
 #include "support/isa/pPIM_isa.h"
 
 using namespace ppim;
@@ -19,14 +21,14 @@ using namespace ppim;
 int main(int argc, char **argv) {
     // Check if a source file was provided
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <source-file> [output-file]\n";
+        std::cerr << "Usage: " << argv[0] << " <source-file> [output-file] [memory-map-prefix]\n";
         return 1;
     }
-
+    
     // Initialize LLVM components
     llvm::LLVMContext context;
     llvm::IRBuilder<> builder(context);
-
+    
     // Create parser
     Parser parser(context);
     
@@ -37,7 +39,7 @@ int main(int argc, char **argv) {
         std::cerr << "Failed to parse input file: " << filename << "\n";
         return 1;
     }
-
+    
     // Create IR generator
     IRGenerator irGenerator(context);
     
@@ -49,7 +51,7 @@ int main(int argc, char **argv) {
     
     // Get the generated module
     auto module = irGenerator.getModule();
-
+    
     // Create optimizer
     Optimizer optimizer;
     
@@ -58,7 +60,7 @@ int main(int argc, char **argv) {
         std::cerr << "Failed to optimize IR\n";
         return 1;
     }
-
+    
     // Create code generator
     CodeGenerator codeGenerator;
     
@@ -68,13 +70,15 @@ int main(int argc, char **argv) {
         std::cerr << "Failed to generate pPIM instructions\n";
         return 1;
     }
-
+    
     // Output the generated pPIM instructions
     std::cout << "Generated pPIM instructions:\n";
     for (const auto &instr : pimInstructions) {
         codeGenerator.printPIMInstruction(instr);
     }
-
+    codeGenerator.printInstructionStats(codeGenerator.collectInstructionStats(pimInstructions));
+    codeGenerator.getSIMDGenerator().printDataflowReport(std::cout);
+    
     // Optionally, save the instructions to a file
     if (argc > 2) {
         std::string outputFile = argv[2];
@@ -84,6 +88,20 @@ int main(int argc, char **argv) {
         }
         std::cout << "Instructions saved to: " << outputFile << "\n";
     }
-
+    
+    // Optionally, export the memory map and access heatmap
+    if (argc > 3) {
+        std::string prefix = argv[3];
+        MemoryMapExporter exporter(codeGenerator.getMemoryMapper());
+        exporter.recordAccesses(pimInstructions);
+        if (!exporter.writeJSON(prefix + ".json") || !exporter.writeCSV(prefix) ||
+            !exporter.writeHeatmap(prefix + ".html")) {
+            std::cerr << "Failed to export memory map: " << prefix << "\n";
+            return 1;
+        }
+        std::cout << "Memory map exported to: " << prefix << ".json, " << prefix << "_*.csv, "
+                  << prefix << ".html\n";
+    }
+    
     return 0;
 }
@@ -18,6 +18,12 @@ uint32_t encodeInstruction(const Instruction& inst) {
     encoded |= (inst.readBit & 0x1) << 15;
     encoded |= (inst.writeBit & 0x1) << 14;
     
+    // Set the host bit
+    encoded |= (inst.hostBit & 0x1) << 9;
+    
+    // Set the operand buffer (2 bits)
+    encoded |= (inst.bufferId & 0x3) << 10;
+    
     // Set the row address (9 bits)
     encoded |= (inst.rowAddress & 0x1FF);
     
@@ -37,12 +43,47 @@ Instruction decodeInstruction(uint32_t encoded) {
     inst.readBit = (encoded >> 15) & 0x1;
     inst.writeBit = (encoded >> 14) & 0x1;
     
+    // Extract the host bit
+    inst.hostBit = (encoded >> 9) & 0x1;
+    
+    // Extract the operand buffer (2 bits)
+    inst.bufferId = (encoded >> 10) & 0x3;
+    
     // Extract the row address (9 bits)
     inst.rowAddress = encoded & 0x1FF;
     
     return inst;
 }
 
+Instruction makeBroadcastProg(uint8_t clusterMask, uint16_t coreMask) {
+    Instruction inst;
+    inst.opcode = 1;
+    inst.readBit = 1;
+    inst.coreId = clusterMask & 0x3F;
+    inst.rowAddress = coreMask & 0x1FF;
+    return inst;
+}
+
+Instruction makeBankSelect(uint8_t bankId, uint16_t subarrayId) {
+    Instruction inst;
+    inst.opcode = 0;
+    inst.hostBit = 1;
+    inst.coreId = bankId & 0x3F;
+    inst.rowAddress = subarrayId & 0x1FF;
+    return inst;
+}
+
+Instruction makeRepeatedExe(uint8_t exeOpcode, uint32_t repeatCount) {
+    Instruction inst;
+    inst.opcode = 2;
+    inst.coreId = exeOpcode & 0x3F;
+    if (repeatCount > 1) {
+        inst.readBit = 1;
+        inst.rowAddress = (repeatCount - 1) & 0x1FF;
+    }
+    return inst;
+}
+
 ControlWord generateControlWordForAdd() {
     ControlWord cw;
     
@@ -94,13 +135,47 @@ std::string instructionToString(const Instruction& inst) {
     
     ss << "Type: " << typeStr << ", ";
     
-    if (inst.opcode == 0) {
+    if (isBankSelect(inst)) {
+        // Bank and subarray the following instructions target
+        ss << "Bank Select, Bank: " << static_cast<int>(inst.coreId)
+           << ", Subarray: " << inst.rowAddress;
+    } else if (inst.opcode == 0 && !inst.readBit && !inst.writeBit) {
+        // Route between clusters
+        ss << "Route, Clusters: 0x" << std::hex << inst.rowAddress << std::dec
+           << ", Distance: " << static_cast<int>(inst.coreId);
+    } else if (inst.opcode == 0) {
         // Memory access instruction
         ss << "R/W: " << inst.readBit << "/" << inst.writeBit << ", ";
+        if (inst.hostBit) {
+            ss << "Host, ";
+        }
         ss << "Row: 0x" << std::hex << std::setw(3) << std::setfill('0') << inst.rowAddress;
+        if (inst.bufferId) {
+            ss << ", Buffer: " << std::dec << inst.bufferId;
+        }
+    } else if (isBroadcastProg(inst)) {
+        // LUT programming of the masked cores of the masked clusters
+        if (inst.coreId) {
+            ss << "Clusters: 0x" << std::hex << static_cast<int>(inst.coreId);
+        } else {
+            ss << "Clusters: all";
+        }
+        ss << ", Cores: 0x" << std::hex << inst.rowAddress << std::dec;
     } else if (inst.opcode == 1) {
         // LUT programming instruction
         ss << "Core: " << static_cast<int>(inst.coreId);
+    } else if (inst.opcode == 2) {
+        // Compute instruction, on a subset of the clusters if the mask is set
+        if (inst.readBit) {
+            ss << "Clusters: all, Repeat: " << getRepeatCount(inst);
+        } else if (inst.rowAddress) {
+            ss << "Clusters: 0x" << std::hex << inst.rowAddress << std::dec;
+        } else {
+            ss << "Clusters: all";
+        }
+        if (inst.bufferId) {
+            ss << ", Buffer: " << inst.bufferId;
+        }
     }
     
     return ss.str();